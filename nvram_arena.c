@@ -0,0 +1,165 @@
+// nvram_arena.c
+// Copyright 2015, Todd Knarr <tknarr@silverglass.org>
+// Licensed under the terms of the GPL v3 or any later version.
+// See LICENSE.md for complete license terms.
+
+//	  This program is free software: you can redistribute it and/or modify
+//	  it under the terms of the GNU General Public License as published by
+//	  the Free Software Foundation, either version 3 of the License, or
+//	  (at your option) any later version.
+
+//	  This program is distributed in the hope that it will be useful,
+//	  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+//	  GNU General Public License for more details.
+
+//	  You should have received a copy of the GNU General Public License
+//	  along with this program.	If not, see <http://www.gnu.org/licenses/>.
+
+// Simple bump allocator. Memory comes from a chain of blocks, the newest
+// first. Individual allocations are never freed; the whole arena is reset
+// between files instead.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nvram_arena.h"
+
+#define ARENA_ALIGN		16
+
+struct arena_block
+{
+	struct arena_block *next;
+	size_t size;	// Bytes available in data
+	size_t used;
+	char data[];
+};
+
+static size_t align_up( size_t n )
+{
+	return ( n + ARENA_ALIGN - 1 ) & ~(size_t) ( ARENA_ALIGN - 1 );
+}
+
+static struct arena_block *new_block( size_t size )
+{
+	struct arena_block *b = malloc( sizeof (struct arena_block) + size );
+	if ( !b )
+		return NULL;
+	b->next = NULL;
+	b->size = size;
+	b->used = 0;
+	return b;
+}
+
+void arena_init( struct arena *a, size_t block_size )
+{
+	a->head = NULL;
+	a->block_size = block_size;
+	a->last = NULL;
+}
+
+void arena_free( struct arena *a )
+{
+	struct arena_block *b = a->head, *next;
+	while ( b )
+	{
+		next = b->next;
+		free( b );
+		b = next;
+	}
+	a->head = NULL;
+	a->last = NULL;
+}
+
+void arena_reset( struct arena *a )
+{
+	a->last = NULL;
+	if ( !a->head )
+		return;
+	if ( !a->head->next )
+	{
+		a->head->used = 0;
+		return;
+	}
+
+	// The last file needed more than one block. Replace the chain with a
+	// single block big enough for all of it so a similar file fits in one.
+	size_t total = 0;
+	struct arena_block *b;
+	for ( b = a->head; b; b = b->next )
+		total += b->size;
+	arena_free( a );
+	a->head = new_block( total );
+}
+
+void *arena_alloc( struct arena *a, size_t size )
+{
+	struct arena_block *b = a->head;
+	size = align_up( size );
+	if ( !b || b->size - b->used < size )
+	{
+		// Each new block is twice the size of the one before it, so a big
+		// file needs only a few blocks.
+		size_t block_size = a->block_size;
+		if ( b && b->size >= block_size )
+			block_size = b->size * 2;
+		while ( block_size < size )
+			block_size *= 2;
+		b = new_block( block_size );
+		if ( !b )
+			return NULL;
+		b->next = a->head;
+		a->head = b;
+	}
+	void *p = b->data + b->used;
+	b->used += size;
+	a->last = p;
+	return p;
+}
+
+void *arena_grow( struct arena *a, void *ptr, size_t old_size, size_t new_size )
+{
+	struct arena_block *b = a->head;
+	if ( ptr && ptr == a->last )
+	{
+		size_t start = (char *) ptr - b->data;
+		if ( start + align_up( new_size ) <= b->size )
+		{
+			b->used = start + align_up( new_size );
+			return ptr;
+		}
+	}
+	void *p = arena_alloc( a, new_size );
+	if ( p && ptr )
+		memcpy( p, ptr, old_size < new_size ? old_size : new_size );
+	return p;
+}
+
+char *arena_read_file( struct arena *a, FILE *f, size_t *size )
+{
+	size_t used = 0, allocated = 65536, read_bytes;
+	char *buffer = arena_alloc( a, allocated );
+	if ( !buffer )
+		return NULL;
+
+	for ( ;; )
+	{
+		read_bytes = fread( buffer + used, sizeof (char), allocated - used - 1, f );
+		used += read_bytes;
+		if ( read_bytes == 0 )
+			break;
+		if ( allocated - used < 4096 )
+		{
+			buffer = arena_grow( a, buffer, used, allocated * 2 );
+			if ( !buffer )
+				return NULL;
+			allocated *= 2;
+		}
+	}
+	if ( ferror( f ) )
+		return NULL;
+	buffer[used] = 0;
+	*size = used;
+	return buffer;
+}
@@ -0,0 +1,42 @@
+// nvram_arena.h
+// Copyright 2015, Todd Knarr <tknarr@silverglass.org>
+// Licensed under the terms of the GPL v3 or any later version.
+// See LICENSE.md for complete license terms.
+
+// Growable arena allocator holding the per-file working memory of
+// nvram_dump and nvram_build. Everything allocated while processing a file
+// is released at once by arena_reset(), which keeps the memory around so
+// the next file normally needs no new allocations.
+
+#ifndef NVRAM_ARENA_H
+#define NVRAM_ARENA_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+struct arena_block;
+
+struct arena
+{
+	struct arena_block *head;	// Block currently being allocated from
+	size_t block_size;			// Size of the first block; each later one doubles
+	void *last;					// Most recent allocation, can be grown in place
+};
+
+void arena_init( struct arena *a, size_t block_size );
+// Releases all memory held by the arena.
+void arena_free( struct arena *a );
+// Frees everything allocated from the arena but keeps the memory for reuse.
+void arena_reset( struct arena *a );
+
+// Returns size bytes aligned for any type, or NULL if out of memory.
+void *arena_alloc( struct arena *a, size_t size );
+// Resizes an allocation, in place if it was the most recent one and there's
+// room. Returns the (possibly moved) allocation, or NULL if out of memory.
+void *arena_grow( struct arena *a, void *ptr, size_t old_size, size_t new_size );
+
+// Reads all of f into arena memory, followed by a terminating NUL that
+// isn't counted in *size. Returns NULL on a read error or out of memory.
+char *arena_read_file( struct arena *a, FILE *f, size_t *size );
+
+#endif // NVRAM_ARENA_H
@@ -21,7 +21,10 @@
 // files are unescaped before writing. Both the normal form and the
 // human-readable form with line breaks can be handled.
 // The '-d' switch causes the output to be written in the form used in the
-// /etc/defaults.ini file for initial default settings.
+// /etc/defaults.ini file for initial default settings. With '--json' the
+// input is JSON, as written by nvram_dump --json, instead. '--patch' writes
+// the nvram commands that change a router's current backup into the built
+// one instead of the backup itself.
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,91 +32,1354 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "nvram_arena.h"
+#include "nvram_compress.h"
+#include "nvram_stats.h"
+#include "nvram_tar.h"
+#include "nvram_trace.h"
 
 // File format
 #define FMT_NVRAM		0
 #define FMT_DEFAULTS	1
 
-int unescape_string( const char *src, char *dest )
+// Long-only options
+#define OPT_STATS		256
+#define OPT_TRACE		257
+#define OPT_STREAM		258
+#define OPT_COMPRESS	259
+#define OPT_TAR			260
+#define OPT_JSON		261
+#define OPT_JSON_BYTES	262
+#define OPT_PATCH		263
+
+// Most threads -j will start.
+#define MAX_THREADS		256
+
+// Smallest file whose lines -j splits between threads, and how many pieces
+// it's split into per thread to even out the work.
+#define PARALLEL_MIN_SIZE	( 256*1024 )
+#define CHUNKS_PER_THREAD	4
+
+// The low-footprint build streams by default and starts with a small arena.
+#ifdef NVRAM_SMALL
+#define DEFAULT_STREAM		1
+#define ARENA_BLOCK_SIZE	( 4*1024 )
+#else
+#define DEFAULT_STREAM		0
+#define ARENA_BLOCK_SIZE	( 256*1024 )
+#endif
+
+// Value of each hex digit, 0xFF for characters that aren't hex digits.
+static const unsigned char hex_value[256] =
+{
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+
+// What the character following a backslash decodes to. Characters not in
+// the table decode to themselves; "\\x" is handled separately.
+static const unsigned char escape_value[256] =
+{
+	[ 'a' ] = '\a', [ 'b' ] = '\b', [ 'f' ] = '\f', [ 'n' ] = '\n',
+	[ 'r' ] = '\r', [ 't' ] = '\t', [ 'v' ] = '\v', [ '\\' ] = '\\'
+};
+
+// Returns a pointer to the first backslash or NUL from p up to end, which
+// points at the string's terminating NUL. Nothing past end is read, so the
+// 16-byte loads stop at the last whole one before it and the rest is looked
+// at a byte at a time; another thread may be writing just past it.
+static const char *find_escape( const char *p, const char *end )
+{
+#ifdef __SSE2__
+	const __m128i backslash = _mm_set1_epi8( '\\' ), zero = _mm_setzero_si128();
+	while ( end - p >= 16 )
+	{
+		__m128i v = _mm_loadu_si128( (const __m128i *) p );
+		int mask = _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( v, backslash ),
+													_mm_cmpeq_epi8( v, zero ) ) );
+		if ( mask )
+			return p + __builtin_ctz( mask );
+		p += 16;
+	}
+	while ( *p != '\\' && *p != 0 )
+		p++;
+	return p;
+#else
+	(void) end;
+	return p + strcspn( p, "\\" );
+#endif
+}
+
+// Unescapes src into dest, which may be the same buffer as src since the
+// result is never longer than the input. end points at src's terminating
+// NUL. Runs of plain characters are copied in bulk; escapes are decoded
+// through the tables above. Returns 0 on success or 1 if a "\\x" escape
+// isn't followed by two hex digits.
+int unescape_string( const char *src, const char *end, char *dest )
 {
 	const char *p = src;
 	char *q = dest;
-	while ( *p )
+	for ( ;; )
 	{
-		if ( *p == '\\' )
+		const char *e = find_escape( p, end );
+		size_t run = e - p;
+		if ( q != p )
+			memmove( q, p, run );
+		q += run;
+		p = e;
+		if ( *p == 0 )
+			break;
+
+		// *p is a backslash
+		unsigned char c = (unsigned char) p[1];
+		if ( c == 'x' )
+		{
+			unsigned char hi = hex_value[(unsigned char) p[2]];
+			if ( hi == 0xFF )
+				return 1;
+			unsigned char lo = hex_value[(unsigned char) p[3]];
+			if ( lo == 0xFF )
+				return 1;
+			*q++ = (char) ( ( hi << 4 ) | lo );
+			p += 4;
+		}
+		else if ( c == 0 )
 		{
+			// Trailing backslash with nothing after it, keep it as-is.
+			*q++ = '\\';
 			p++;
-			switch ( *p )
+		}
+		else
+		{
+			*q++ = escape_value[c] ? (char) escape_value[c] : (char) c;
+			p += 2;
+		}
+	}
+	*q = 0;
+	return 0;
+}
+
+// JSON input, read with --json. The input is any number of objects, one
+// after another (JSON lines) or in a top-level array. An object with "name"
+// and "value" members is one record, and the members of an object's
+// "values" object are a record each; nvram_dump --json writes both kinds.
+// Other members are skipped. Strings are decoded as they're read straight
+// into the record's name or value. \u0000 to \u00FF give the byte with that
+// value, the way nvram_dump writes them, and higher code points are encoded
+// as UTF-8.
+
+// Bytes of input read at a time.
+#define JSON_BUFFER		( 64*1024 )
+// Most of a name or value kept, as much as a record can hold.
+#define JSON_NAME_MAX	0xFF
+#define JSON_VALUE_MAX	0xFFFF
+
+// Where json_next() is in the input.
+#define JSON_TOP		0	// Between objects
+#define JSON_OBJECT		1	// Among an object's members
+#define JSON_VALUES		2	// Among the members of an object's "values"
+
+struct json_reader
+{
+	FILE *f;
+	const char *filename;
+	char *buffer;				// Input read from f, JSON_BUFFER bytes
+	size_t pos;
+	size_t len;
+	unsigned long long bytes_read;
+	int line_number;
+	int state;
+	int in_array;				// Objects are in a top-level array
+	int bytes;					// \u0080 to \u00FF are single bytes, not UTF-8
+	int first;					// Nothing read yet in the array or object
+	int have_name;				// Object has had a "name" or "value", 1 if
+	int have_value;				// it's usable or -1 if it isn't
+	char *name;					// The record, JSON_NAME_MAX bytes
+	size_t name_len;
+	char *value;				// JSON_VALUE_MAX bytes
+	size_t value_len;
+};
+
+// Starts reading JSON from f, with buffers from the arena. Returns 0 on
+// success or 1 if out of memory.
+static int json_open( struct json_reader *j, struct arena *a, FILE *f, const char *filename )
+{
+	memset( j, 0, sizeof (struct json_reader) );
+	j->f = f;
+	j->filename = filename;
+	j->line_number = 1;
+	j->state = JSON_TOP;
+	j->first = 1;
+	j->buffer = arena_alloc( a, JSON_BUFFER );
+	j->name = arena_alloc( a, JSON_NAME_MAX );
+	j->value = arena_alloc( a, JSON_VALUE_MAX );
+	return ( j->buffer && j->name && j->value ) ? 0 : 1;
+}
+
+// Returns the next character without taking it, or -1 at the end of the
+// input.
+static int json_peek( struct json_reader *j )
+{
+	if ( j->pos == j->len )
+	{
+		j->pos = 0;
+		j->len = fread( j->buffer, sizeof (char), JSON_BUFFER, j->f );
+		j->bytes_read += j->len;
+		if ( j->len == 0 )
+			return -1;
+	}
+	return (unsigned char) j->buffer[j->pos];
+}
+
+static int json_getc( struct json_reader *j )
+{
+	int c = json_peek( j );
+	if ( c >= 0 )
+	{
+		j->pos++;
+		if ( c == '\n' )
+			j->line_number++;
+	}
+	return c;
+}
+
+// Skips whitespace, returning the character after it without taking it.
+static int json_skip_space( struct json_reader *j )
+{
+	int c;
+	while ( ( c = json_peek( j ) ) == ' ' || c == '\t' || c == '\n' || c == '\r' )
+		json_getc( j );
+	return c;
+}
+
+// Reports a problem with a record, which is skipped.
+static void json_warn( struct json_reader *j, const char *message )
+{
+	fprintf( stderr, "build_file: %s: Line %d: %s\n", j->filename, j->line_number, message );
+}
+
+// Reports a syntax error, which ends the file. Returns -1.
+static int json_error( struct json_reader *j, const char *message )
+{
+	json_warn( j, message );
+	return -1;
+}
+
+// Adds a decoded byte to dest, if there's still room below max.
+static void json_put( char *dest, size_t max, size_t *len, int c )
+{
+	if ( *len < max )
+		dest[*len] = (char) c;
+	(*len)++;
+}
+
+// Reads the four hex digits of a \u escape. Returns -1 if they aren't.
+static long json_hex4( struct json_reader *j )
+{
+	long v = 0;
+	int i;
+	for ( i = 0; i < 4; i++ )
+	{
+		int c = json_getc( j );
+		if ( c < 0 || hex_value[c] == 0xFF )
+			return -1;
+		v = v * 16 + hex_value[c];
+	}
+	return v;
+}
+
+// Reads the rest of a string whose opening quote has been taken, decoding
+// it into dest. *len is set to the decoded length, of which only the first
+// max bytes are kept. As with text input a NUL ends the string. \u escapes
+// are written as UTF-8, apart from \u0080 to \u00FF with --json-bytes,
+// which are the single byte with that value the way nvram_dump --json-bytes
+// writes them. Returns 0, or -1 on a syntax error.
+static int json_read_string( struct json_reader *j, char *dest, size_t max, size_t *len )
+{
+	*len = 0;
+	for ( ;; )
+	{
+		if ( json_peek( j ) < 0 )
+			return json_error( j, "unterminated string" );
+
+		// Copy runs of plain characters in bulk.
+		const char *p = j->buffer + j->pos, *end = j->buffer + j->len, *q = p;
+		while ( q < end && *q != '"' && *q != '\\' && (unsigned char) *q >= 0x20 )
+			q++;
+		if ( q > p )
+		{
+			size_t n = q - p;
+			if ( *len < max )
+				memcpy( dest + *len, p, n < max - *len ? n : max - *len );
+			*len += n;
+			j->pos += n;
+			continue;
+		}
+
+		int c = json_getc( j );
+		if ( c == '"' )
+			break;
+		if ( c != '\\' )
+		{
+			if ( c == '\n' )
+				j->line_number--; // Report the line the string is on
+			return json_error( j, "control character in string" );
+		}
+		c = json_getc( j );
+		switch ( c )
+		{
+		case '"':
+		case '\\':
+		case '/':
+			json_put( dest, max, len, c );
+			break;
+		case 'b':  json_put( dest, max, len, '\b' ); break;
+		case 'f':  json_put( dest, max, len, '\f' ); break;
+		case 'n':  json_put( dest, max, len, '\n' ); break;
+		case 'r':  json_put( dest, max, len, '\r' ); break;
+		case 't':  json_put( dest, max, len, '\t' ); break;
+		case 'u':
+		{
+			long cp = json_hex4( j ), lo;
+			if ( cp < 0 )
+				return json_error( j, "bad \\u escape in string" );
+			if ( cp >= 0xD800 && cp < 0xDC00 )
 			{
-			case 'a':
-				*q = '\a';
-				p++; q++;
-				break;
-			case 'b':
-				*q = '\b';
-				p++; q++;
-				break;
-			case 'f':
-				*q = '\f';
-				p++; q++;
-				break;
-			case 'n':
-				*q = '\n';
-				p++; q++;
-				break;
-			case 'r':
-				*q = '\r';
-				p++; q++;
-				break;
-			case 't':
-				*q = '\t';
-				p++; q++;
-				break;
-			case 'v':
-				*q = '\v';
-				p++; q++;
-				break;
-			case '\\':
-				*q = '\\';
-				p++; q++;
-				break;
+				// A high surrogate, which the low one has to follow.
+				if ( json_getc( j ) != '\\' || json_getc( j ) != 'u' ||
+					 ( lo = json_hex4( j ) ) < 0xDC00 || lo > 0xDFFF )
+					return json_error( j, "bad \\u escape in string" );
+				cp = 0x10000 + ( ( cp - 0xD800 ) << 10 ) + ( lo - 0xDC00 );
+			}
+			else if ( cp >= 0xDC00 && cp <= 0xDFFF )
+				return json_error( j, "bad \\u escape in string" ); // A low surrogate on its own
+			if ( cp <= 0x7F || ( j->bytes && cp <= 0xFF ) )
+				json_put( dest, max, len, cp );
+			else if ( cp <= 0x7FF )
+			{
+				json_put( dest, max, len, 0xC0 | ( cp >> 6 ) );
+				json_put( dest, max, len, 0x80 | ( cp & 0x3F ) );
+			}
+			else if ( cp <= 0xFFFF )
+			{
+				json_put( dest, max, len, 0xE0 | ( cp >> 12 ) );
+				json_put( dest, max, len, 0x80 | ( ( cp >> 6 ) & 0x3F ) );
+				json_put( dest, max, len, 0x80 | ( cp & 0x3F ) );
+			}
+			else
+			{
+				json_put( dest, max, len, 0xF0 | ( cp >> 18 ) );
+				json_put( dest, max, len, 0x80 | ( ( cp >> 12 ) & 0x3F ) );
+				json_put( dest, max, len, 0x80 | ( ( cp >> 6 ) & 0x3F ) );
+				json_put( dest, max, len, 0x80 | ( cp & 0x3F ) );
+			}
+			break;
+		}
+		default:
+			return json_error( j, "bad escape in string" );
+		}
+	}
 
-			case 'x':
-				{
-					p++;
-					char s[3];
-					s[0] = *p;
-					s[1] = *(p+1);
-					s[2] = 0;
-					char *eptr = NULL;
-					errno = 0;
-					long v = strtol( s, &eptr, 16 );
-					if ( eptr != s+2 || errno != 0 )
-						return 1;
-					*q = (char) v;
-					p += 2;
-				}
-				q++;
-				break;
+	size_t kept = *len < max ? *len : max;
+	if ( kept > 0 )
+	{
+		const char *nul = memchr( dest, 0, kept );
+		if ( nul )
+			*len = nul - dest;
+	}
+	return 0;
+}
 
-			default:
-				*q = *p;
-				p++; q++;
-				break;
+// Takes the literal word, which the input has to match. Returns 0, or -1
+// if it doesn't.
+static int json_literal( struct json_reader *j, const char *word )
+{
+	for ( ; *word; word++ )
+	{
+		if ( json_getc( j ) != *word )
+			return json_error( j, "unknown literal" );
+	}
+	return 0;
+}
+
+static int json_is_number( int c )
+{
+	return ( c >= '0' && c <= '9' ) || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+}
+
+// Skips over a value of any kind. Returns 0, or -1 on a syntax error.
+static int json_skip_value( struct json_reader *j )
+{
+	int depth = 0;
+	size_t len;
+	do
+	{
+		int c = json_skip_space( j );
+		if ( c < 0 )
+			return json_error( j, "unexpected end of input" );
+		if ( c == '"' )
+		{
+			json_getc( j );
+			if ( json_read_string( j, NULL, 0, &len ) != 0 )
+				return -1;
+		}
+		else if ( c == '{' || c == '[' )
+		{
+			json_getc( j );
+			depth++;
+		}
+		else if ( ( c == '}' || c == ']' || c == ',' || c == ':' ) && depth > 0 )
+		{
+			json_getc( j );
+			if ( c == '}' || c == ']' )
+				depth--;
+		}
+		else if ( c == 't' || c == 'f' || c == 'n' )
+		{
+			if ( json_literal( j, c == 't' ? "true" : c == 'f' ? "false" : "null" ) != 0 )
+				return -1;
+		}
+		else if ( json_is_number( c ) )
+		{
+			while ( json_is_number( json_peek( j ) ) )
+				json_getc( j );
+		}
+		else
+			return json_error( j, "expected a value" );
+	} while ( depth > 0 );
+	return 0;
+}
+
+// Reads a value that can be a name or value: a string, a number, kept as
+// it's written, or true or false, which become 1 and 0 the way DD-WRT
+// stores them. Returns 0, 1 if it's some other kind of value, which is
+// skipped, or -1 on a syntax error.
+static int json_read_scalar( struct json_reader *j, char *dest, size_t max, size_t *len )
+{
+	int c = json_skip_space( j );
+	*len = 0;
+	if ( c == '"' )
+	{
+		json_getc( j );
+		return json_read_string( j, dest, max, len );
+	}
+	if ( json_is_number( c ) )
+	{
+		while ( json_is_number( json_peek( j ) ) )
+			json_put( dest, max, len, json_getc( j ) );
+		return 0;
+	}
+	if ( c == 't' || c == 'f' )
+	{
+		if ( json_literal( j, c == 't' ? "true" : "false" ) != 0 )
+			return -1;
+		json_put( dest, max, len, c == 't' ? '1' : '0' );
+		return 0;
+	}
+	return json_skip_value( j ) != 0 ? -1 : 1;
+}
+
+// Reads up to the end of the next record, leaving its name and value in j.
+// Returns 1 if there is one, 0 at the end of the input or -1 on a syntax
+// error. Records that can't be used are reported and skipped.
+static int json_next( struct json_reader *j )
+{
+	char key[8];
+	size_t key_len;
+	int c, sts;
+	for ( ;; )
+	{
+		c = json_skip_space( j );
+		if ( j->state == JSON_TOP )
+		{
+			if ( c < 0 )
+				return j->in_array ? json_error( j, "unexpected end of input" ) : 0;
+			if ( c == '[' && j->first && !j->in_array )
+			{
+				json_getc( j );
+				j->in_array = 1;
+				continue;
+			}
+			if ( j->in_array && c == ']' )
+			{
+				json_getc( j );
+				j->in_array = 0;
+				j->first = 0;
+				continue;
 			}
+			if ( j->in_array && !j->first )
+			{
+				if ( c != ',' )
+					return json_error( j, "expected ',' or ']'" );
+				json_getc( j );
+				c = json_skip_space( j );
+			}
+			if ( c != '{' )
+				return json_error( j, "expected an object" );
+			json_getc( j );
+			j->state = JSON_OBJECT;
+			j->first = 1;
+			j->have_name = 0;
+			j->have_value = 0;
+			continue;
 		}
+
+		// In an object, at its end or the next member.
+		if ( c == '}' )
+		{
+			json_getc( j );
+			if ( j->state == JSON_VALUES )
+			{
+				j->state = JSON_OBJECT;
+				j->first = 0;
+				continue;
+			}
+			j->state = JSON_TOP;
+			j->first = 0;
+			if ( ( !j->have_name && !j->have_value ) || j->have_name < 0 || j->have_value < 0 )
+				continue; // Nothing there, or already reported
+			if ( !j->have_name )
+				json_warn( j, "missing name" );
+			else if ( !j->have_value )
+				json_warn( j, "missing value" );
+			else if ( j->name_len == 0 )
+				json_warn( j, "name is empty" );
+			else
+				return 1;
+			continue;
+		}
+		if ( !j->first )
+		{
+			if ( c != ',' )
+				return json_error( j, "expected ',' or '}'" );
+			json_getc( j );
+			c = json_skip_space( j );
+		}
+		j->first = 0;
+		if ( c != '"' )
+			return json_error( j, "expected a member name" );
+		json_getc( j );
+		if ( j->state == JSON_VALUES )
+			sts = json_read_string( j, j->name, JSON_NAME_MAX, &j->name_len );
 		else
+			sts = json_read_string( j, key, sizeof key, &key_len );
+		if ( sts != 0 )
+			return -1;
+		if ( json_skip_space( j ) != ':' )
+			return json_error( j, "expected ':'" );
+		json_getc( j );
+
+		if ( j->state == JSON_VALUES )
+		{
+			// Each member is a record.
+			sts = json_read_scalar( j, j->value, JSON_VALUE_MAX, &j->value_len );
+			if ( sts < 0 )
+				return -1;
+			if ( sts > 0 )
+				json_warn( j, "value isn't a string, number or boolean" );
+			else if ( j->name_len == 0 )
+				json_warn( j, "name is empty" );
+			else
+				return 1;
+		}
+		else if ( key_len == 4 && memcmp( key, "name", 4 ) == 0 )
 		{
-			*q = *p;
-			p++; q++;
+			sts = json_read_scalar( j, j->name, JSON_NAME_MAX, &j->name_len );
+			if ( sts < 0 )
+				return -1;
+			if ( sts > 0 )
+				json_warn( j, "name isn't a string, number or boolean" );
+			j->have_name = ( sts == 0 ) ? 1 : -1;
 		}
+		else if ( key_len == 5 && memcmp( key, "value", 5 ) == 0 )
+		{
+			sts = json_read_scalar( j, j->value, JSON_VALUE_MAX, &j->value_len );
+			if ( sts < 0 )
+				return -1;
+			if ( sts > 0 )
+				json_warn( j, "value isn't a string, number or boolean" );
+			j->have_value = ( sts == 0 ) ? 1 : -1;
+		}
+		else if ( key_len == 6 && memcmp( key, "values", 6 ) == 0 && json_skip_space( j ) == '{' )
+		{
+			json_getc( j );
+			j->state = JSON_VALUES;
+			j->first = 1;
+		}
+		else if ( json_skip_value( j ) != 0 )
+			return -1;
 	}
-	*q = 0;
+}
+
+// One name=value line from the input, pointing into the input buffer.
+struct text_record
+{
+	char *name;
+	char *value;
+	char *end;					// The value's terminating NUL
+	int line_number;
+};
+
+// All of the state for building files. Nothing in here is shared with other
+// contexts, so separate contexts can be used from separate threads.
+struct build_context
+{
+	int file_format;
+	int stream;					// Use build_stream() instead of reading whole files
+	int json;					// Input is JSON rather than name=value lines
+	int json_bytes;				// JSON \u0080 to \u00FF are single bytes
+	int raw;					// Input is unescaped name=value entries ended by NULs
+	int threads;				// Threads for parsing one big file, from -j
+	struct arena arena;			// Working memory, reset for each file
+	struct nvram_stats total;	// Running totals for --stats across all files
+};
+
+void build_init( struct build_context *ctx, int file_format )
+{
+	ctx->file_format = file_format;
+	ctx->stream = DEFAULT_STREAM;
+	ctx->json = 0;
+	ctx->json_bytes = 0;
+	ctx->raw = 0;
+	ctx->threads = 1;
+	arena_init( &ctx->arena, ARENA_BLOCK_SIZE );
+	stats_clear( &ctx->total );
+}
+
+void build_cleanup( struct build_context *ctx )
+{
+	arena_free( &ctx->arena );
+}
+
+// Writes a length of len_size bytes, low byte first.
+static void write_length( char *p, unsigned int len, size_t len_size )
+{
+	p[0] = len & 0xFF; // TODO byte ordering
+	if ( len_size == 2 )
+		p[1] = ( len >> 8 ) & 0xFF;
+}
+
+// Reads a length of len_size bytes, low byte first.
+static unsigned int read_length( const unsigned char *p, size_t len_size )
+{
+	return ( len_size == 1 ) ? p[0] : p[1] * 256 + p[0]; // TODO byte ordering
+}
+
+// Reads the record count out of the header at the start of a backup.
+static unsigned int read_record_count( int file_format, const unsigned char *header )
+{
+	return read_length( header + ( ( file_format == FMT_DEFAULTS ) ? 0 : 6 ), 2 );
+}
+
+// Encodes a record at out, which needs room for the name and value plus 3
+// bytes. Lengths too big for the format are cut down to the bytes that fit
+// in the length fields. Returns the length of the record.
+static size_t encode_record( char *out, const char *name, size_t name_len, const char *value,
+							 size_t value_len, int file_format )
+{
+	int len = name_len & 0xFF; // Only 1 byte for the name length
+	out[0] = len;
+	memcpy( out+1, name, len );
+	int vstart = len+1;
+	size_t len_size = ( file_format == FMT_DEFAULTS ) ? 1 : 2;
+	len = value_len & ( ( len_size == 1 ) ? 0xFF : 0xFFFF ); // Only 1 or 2 bytes for the value length
+	write_length( out+vstart, len, len_size );
+	vstart += len_size;
+	memcpy( out+vstart, value, len );
+	return vstart + len;
+}
+
+// Builds the records in a JSON file being read from f. If output_file is
+// given each record is written to it as soon as it's read, otherwise they're
+// all encoded into memory from ctx's arena, pointed to by *output_records.
+// Returns the number of records, or -1 if an error occurred.
+static int json_file( struct build_context *ctx, FILE *f, const char *filename, FILE *output_file,
+					  char **output_records, size_t *output_size, struct nvram_stats *stats,
+					  double *t_start )
+{
+	struct json_reader j;
+	size_t allocated = output_file ? 1 + JSON_NAME_MAX + 2 + JSON_VALUE_MAX : 65536, used = 0;
+	char *output = NULL;
+	if ( json_open( &j, &ctx->arena, f, filename ) != 0 ||
+		 !( output = arena_alloc( &ctx->arena, allocated ) ) )
+	{
+		fprintf( stderr, "build_file: %s: Out of memory\n", filename );
+		return -1;
+	}
+	j.bytes = ctx->json_bytes;
+
+	int sts, record_count = 0;
+	while ( ( sts = json_next( &j ) ) > 0 )
+	{
+		size_t needed = used + 3 + ( j.name_len & 0xFF ) + ( j.value_len & 0xFFFF );
+		if ( needed > allocated )
+		{
+			size_t size = allocated;
+			while ( size < needed )
+				size *= 2;
+			output = arena_grow( &ctx->arena, output, used, size );
+			if ( !output )
+			{
+				fprintf( stderr, "build_file: %s: Out of memory\n", filename );
+				return -1;
+			}
+			allocated = size;
+		}
+		size_t record_len = encode_record( output + used, j.name, j.name_len, j.value, j.value_len,
+										   ctx->file_format );
+		record_count++;
+		stats_record( stats, record_len );
+		if ( !output_file )
+		{
+			used += record_len;
+			continue;
+		}
+		stats_phase_add( stats, PHASE_PARSE, t_start );
+		if ( fwrite( output, sizeof (char), record_len, output_file ) != record_len )
+		{
+			fprintf( stderr, "build_file: %s: Line %d: error writing record %d\n",
+					 filename, j.line_number, record_count );
+			return -1;
+		}
+		stats->bytes_out += record_len;
+		stats_phase_add( stats, PHASE_OUTPUT, t_start );
+	}
+	stats->bytes_in += j.bytes_read;
+	if ( sts < 0 )
+		return -1;
+	if ( !output_file )
+	{
+		stats_phase_end( stats, PHASE_PARSE, t_start, filename );
+		*output_records = output;
+		*output_size = used;
+	}
+	return record_count;
+}
+
+// Reads one line from f into the arena-allocated *line, growing it as
+// needed. Human-readable line breaks (a backslash at the end of the line)
+// are turned into "\n" escapes and the next line is joined on, the same as
+// build_file() does for the whole buffer. If raw is set the line is a raw
+// entry ended by a NUL instead. The line starts at offset 1 in *line to
+// leave room for the name length byte. Returns the length of the line
+// without its newline, -1 at the end of the file or -2 if there isn't
+// enough memory for it.
+static long read_line( struct arena *a, FILE *f, int raw, char **line, size_t *allocated )
+{
+	size_t len = 0;
+	int c;
+
+	while ( ( c = getc( f ) ) != EOF )
+	{
+		if ( raw && c == 0 )
+			break;
+		if ( len + 3 > *allocated )
+		{
+			char *p = arena_grow( a, *line, *allocated, *allocated * 2 );
+			if ( !p )
+				return -2;
+			*line = p;
+			*allocated *= 2;
+		}
+		if ( c == '\n' && !raw )
+		{
+			if ( len > 0 && (*line)[len] == '\\' )
+			{
+				(*line)[++len] = 'n';
+				continue;
+			}
+			break;
+		}
+		(*line)[++len] = (char) c;
+	}
+	if ( c == EOF && len == 0 )
+		return -1;
+	(*line)[len+1] = 0;
+	return len;
+}
+
+// Builds records from a file one line at a time, writing each one as soon
+// as it's complete. Memory use is set by the longest line in the file, not
+// its total size. Returns the number of records written, or -1 if an error
+// occurred.
+int build_stream( struct build_context *ctx, FILE *output_file, const char *filename )
+{
+	int file_format = ctx->file_format;
+	struct nvram_stats stats;
+	stats_clear( &stats );
+	double t_file = stats_now(), t_start = t_file;
+
+	FILE *f = compress_open( filename );
+	if ( !f )
+	{
+		int code = errno;
+		char *errstr = strerror( code );
+		fprintf( stderr, "build_file: Error opening %s for input: %s\n", filename, errstr );
+		return -1;
+	}
+
+	arena_reset( &ctx->arena );
+	size_t allocated = 1024;
+	char *line = arena_alloc( &ctx->arena, allocated );
+	if ( !line )
+	{
+		fprintf( stderr, "build_file: %s: Out of memory\n", filename );
+		compress_close( f );
+		return -1;
+	}
+
+	int record_count = 0, line_number = 0, ret = 0;
+	long line_len = -1;
+	if ( ctx->json )
+	{
+		// JSON is always parsed as it's read, so streaming it just means
+		// writing each record out as soon as it's complete.
+		record_count = json_file( ctx, f, filename, output_file, NULL, NULL, &stats, &t_start );
+		if ( record_count < 0 )
+			ret = -1;
+	}
+	else while ( ( line_len = read_line( &ctx->arena, f, ctx->raw, &line, &allocated ) ) >= 0 )
+	{
+		line_number++;
+		stats.bytes_in += line_len + 1;
+		stats_phase_add( &stats, PHASE_READ, &t_start );
+
+		char *name = line + 1;
+		char *p_equals = strchr( name, '=' );
+		if ( !p_equals )
+		{
+			fprintf( stderr, "build_file: %s: Line %d: missing equals sign\n", filename, line_number );
+			continue;
+		}
+		*p_equals = 0;
+		char *value = p_equals + 1;
+		if ( strlen( name ) == 0 )
+		{
+			fprintf( stderr, "build_file: %s: Line %d: name is empty\n", filename, line_number );
+			continue;
+		}
+		stats_phase_add( &stats, PHASE_PARSE, &t_start );
+
+		// Raw entries have nothing to unescape.
+		if ( !ctx->raw && unescape_string( name, p_equals, name ) != 0 )
+		{
+			fprintf( stderr, "build_file: %s: Line %d: problem unescaping name\n", filename, line_number );
+			continue;
+		}
+		if ( !ctx->raw && unescape_string( value, line + 1 + line_len, value ) != 0 )
+		{
+			fprintf( stderr, "build_file: %s: Line %d: problem unescaping value\n", filename, line_number );
+			continue;
+		}
+		stats_phase_add( &stats, PHASE_ESCAPE, &t_start );
+
+		// Turn the line into a record in place. The name moves up against
+		// its length byte at the start of the buffer, and the value length
+		// takes the place of the '=' (and one more byte for a 2-byte length,
+		// moving the value along by one).
+		int name_len = strlen( name ) & 0xFF; // Only 1 byte for the name length
+		int len = strlen( value );
+		char *record = line;
+		record[0] = name_len;
+		char *p = record + 1 + name_len;
+		size_t len_size = ( file_format == FMT_DEFAULTS ) ? 1 : 2;
+		len &= ( len_size == 1 ) ? 0xFF : 0xFFFF; // Only 1 or 2 bytes for the value length
+		memmove( p + len_size, value, len );
+		write_length( p, len, len_size );
+		p += len_size;
+		size_t record_len = p + len - record;
+		if ( fwrite( record, sizeof (char), record_len, output_file ) != record_len )
+		{
+			fprintf( stderr, "build_file: %s: Line %d: error writing record %d\n",
+					 filename, line_number, record_count+1 );
+			ret = -1;
+			break;
+		}
+		record_count++;
+		stats_record( &stats, record_len );
+		stats.bytes_out += record_len;
+		stats_phase_add( &stats, PHASE_OUTPUT, &t_start );
+	}
+	if ( line_len == -2 )
+	{
+		fprintf( stderr, "build_file: %s: Line %d: Out of memory\n", filename, line_number+1 );
+		ret = -1;
+	}
+	int read_error = ferror( f );
+	if ( compress_close( f ) != 0 || read_error )
+	{
+		fprintf( stderr, "build_file: Problem reading %s\n", filename );
+		ret = -1;
+	}
+	trace_span( "build_file", "file", t_file, stats_now(), filename );
+
+	stats.files = 1;
+	if ( stats_enabled )
+		stats_report( stderr, filename, &stats );
+	stats_add( &ctx->total, &stats );
+
+	return ret < 0 ? ret : record_count;
+}
+
+// A run of whole lines of a file, parsed, unescaped and encoded as one piece
+// of work by encode_file().
+struct parse_chunk
+{
+	char *start;				// Lines from start up to but not including end
+	char *end;
+	struct text_record *lines;	// Lines with a usable name and value
+	int line_count;
+	int lines_seen;				// All lines in the chunk, including bad ones
+	int line_base;				// Lines in the file before this chunk
+	struct line_error *errors;	// Problems found, malloc()ed
+	int error_count;
+	int errors_reported;
+	int errors_lost;			// Set if a problem couldn't be noted
+	char *output;				// Where the chunk's records go
+	size_t used;				// Bytes of records from the chunk
+	struct nvram_stats stats;	// Records counted from the chunk
+};
+
+// A line that couldn't be used. line_number counts from the start of the
+// chunk until it's reported.
+struct line_error
+{
+	int line_number;
+	const char *message;
+};
+
+// The chunks of one file, shared by the threads working on them. Each
+// thread takes the next chunk not yet claimed until they're all done.
+struct parse_job
+{
+	struct parse_chunk *chunks;
+	int chunk_count;
+	int next;
+	int file_format;
+	int raw;
+};
+
+// Notes a problem with a line of a chunk, to be reported in order once all
+// of the chunks are done. If there's no memory to note it, the file fails.
+static void add_error( struct parse_chunk *c, int line_number, const char *message )
+{
+	if ( ( c->error_count & ( c->error_count + 1 ) ) == 0 )
+	{
+		// Count is 0 or one less than a power of 2, double the room
+		struct line_error *errors = realloc( c->errors, ( c->error_count + 1 ) * 2 * sizeof (struct line_error) );
+		if ( !errors )
+		{
+			c->errors_lost = 1;
+			return;
+		}
+		c->errors = errors;
+	}
+	c->errors[c->error_count].line_number = line_number;
+	c->errors[c->error_count].message = message;
+	c->error_count++;
+}
+
+// Reports the problems the last pass over the chunks found, in line order.
+// Returns 0, or 1 if some couldn't be noted for lack of memory.
+static int report_errors( const char *filename, struct parse_chunk *chunks, int chunk_count )
+{
+	int k, e, lost = 0;
+	for ( k = 0; k < chunk_count; k++ )
+	{
+		struct parse_chunk *c = &chunks[k];
+		for ( e = c->errors_reported; e < c->error_count; e++ )
+			fprintf( stderr, "build_file: %s: Line %d: %s\n", filename,
+					 c->line_base + c->errors[e].line_number, c->errors[e].message );
+		c->errors_reported = c->error_count;
+		lost |= c->errors_lost;
+	}
+	if ( lost )
+		fprintf( stderr, "build_file: %s: Out of memory noting problems\n", filename );
+	return lost;
+}
+
+static void free_errors( struct parse_chunk *chunks, int chunk_count )
+{
+	int k;
+	for ( k = 0; k < chunk_count; k++ )
+		free( chunks[k].errors );
+}
+
+// Parses a chunk's lines into name and value strings in place. If raw is
+// set the "lines" are raw entries ended by NULs instead of newlines.
+static void parse_lines( struct parse_chunk *c, int raw )
+{
+	char *p, *p_start = c->start, *p_end = c->end;
+
+	// Human-readable newlines are a backslash followed by a newline, which is
+	// backslash followed by 'n' in fully-escaped form. So run through the chunk
+	// and make that substitution to avoid complicated code for splicing together
+	// multiple lines.
+	for ( p = p_start; !raw && p + 1 < p_end; p++ )
+	{
+		if ( p[0] == '\\' && p[1] == '\n' )
+			p[1] = 'n';
+	}
+
+	int line_number = 0;
+	while ( p_start < p_end )
+	{
+		line_number++;
+		char *p_newline = memchr( p_start, raw ? 0 : '\n', p_end - p_start );
+		if ( !p_newline )
+			p_newline = p_end; // Last line lacks a newline character
+		char *p_equals = memchr( p_start, '=', p_newline - p_start );
+		if ( !p_equals )
+		{
+			// Error, no equals sign on the line
+			add_error( c, line_number, "missing equals sign" );
+			p_start = p_newline + 1;
+			continue;
+		}
+		// Terminate our parts to give us usable strings.
+		*p_newline = 0;
+		*p_equals = 0;
+		// Convenient names for our name and value strings.
+		char *name = p_start;
+		char *value = p_equals + 1;
+		// And set up past the newline for the next iteration.
+		p_start = p_newline + 1;
+		// Sanity checks.
+		if ( *name == 0 )
+		{
+			add_error( c, line_number, "name is empty" );
+			continue;
+		}
+		c->lines[c->line_count].name = name;
+		c->lines[c->line_count].value = value;
+		c->lines[c->line_count].end = p_newline;
+		c->lines[c->line_count].line_number = line_number;
+		c->line_count++;
+	}
+	c->lines_seen = line_number;
+}
+
+// Unescapes a chunk's names and values in place and works out how big its
+// records will be.
+static void unescape_lines( struct parse_chunk *c, int file_format, int raw )
+{
+	int n;
+	for ( n = 0; n < c->line_count; n++ )
+	{
+		struct text_record *line = &c->lines[n];
+		// Raw entries have nothing to unescape, only their sizes to work out.
+		if ( !raw && unescape_string( line->name, line->value - 1, line->name ) != 0 )
+		{
+			add_error( c, line->line_number, "problem unescaping name" );
+			line->name = NULL;
+			continue;
+		}
+		if ( !raw && unescape_string( line->value, line->end, line->value ) != 0 )
+		{
+			add_error( c, line->line_number, "problem unescaping value" );
+			line->name = NULL;
+			continue;
+		}
+		// Names have 1 byte for their length, values 1 or 2 depending on the format.
+		int record_len = 1 + ( strlen( line->name ) & 0xFF );
+		if ( file_format == FMT_DEFAULTS )
+			record_len += 1 + ( strlen( line->value ) & 0xFF );
+		else
+			record_len += 2 + ( strlen( line->value ) & 0xFFFF );
+		c->used += record_len;
+		stats_record( &c->stats, record_len );
+	}
+}
+
+// Converts a chunk's names and values into records at c->output.
+static void encode_lines( struct parse_chunk *c, int file_format )
+{
+	char *output_buffer = c->output; // Build output records here
+	int n;
+	for ( n = 0; n < c->line_count; n++ )
+	{
+		char *name = c->lines[n].name;
+		char *value = c->lines[n].value;
+		if ( !name )
+			continue;
+		output_buffer += encode_record( output_buffer, name, strlen( name ), value, strlen( value ),
+										file_format );
+	}
+}
+
+static void *parse_worker( void *arg )
+{
+	struct parse_job *job = arg;
+	int k;
+	while ( ( k = __atomic_fetch_add( &job->next, 1, __ATOMIC_RELAXED ) ) < job->chunk_count )
+		parse_lines( &job->chunks[k], job->raw );
+	return NULL;
+}
+
+static void *unescape_worker( void *arg )
+{
+	struct parse_job *job = arg;
+	int k;
+	while ( ( k = __atomic_fetch_add( &job->next, 1, __ATOMIC_RELAXED ) ) < job->chunk_count )
+		unescape_lines( &job->chunks[k], job->file_format, job->raw );
+	return NULL;
+}
+
+static void *encode_worker( void *arg )
+{
+	struct parse_job *job = arg;
+	int k;
+	while ( ( k = __atomic_fetch_add( &job->next, 1, __ATOMIC_RELAXED ) ) < job->chunk_count )
+		encode_lines( &job->chunks[k], job->file_format );
+	return NULL;
+}
+
+// Runs fn on up to threads threads, one of them the calling thread, and
+// waits for them all to finish. A job with one chunk stays on this thread.
+static void parse_run( int threads, void *(*fn)( void * ), void *arg )
+{
+	struct parse_job *job = arg;
+	pthread_t tids[MAX_THREADS];
+	int i, started = 0;
+	if ( threads > job->chunk_count )
+		threads = job->chunk_count;
+	if ( threads > MAX_THREADS )
+		threads = MAX_THREADS;
+	for ( i = 1; i < threads; i++ )
+	{
+		if ( pthread_create( &tids[started], NULL, fn, arg ) != 0 )
+			break;
+		started++;
+	}
+	fn( arg );
+	for ( i = 0; i < started; i++ )
+		pthread_join( tids[i], NULL );
+}
+
+// Reads a file and encodes its records in backup format into memory from
+// ctx's arena, pointed to by *output. If data isn't NULL it's the file's
+// contents, already read in and NUL-terminated, and is parsed in place
+// instead of reading the file again. Returns the number of records, or -1
+// if an error occurred.
+static int encode_file( struct build_context *ctx, const char *filename, char *data, size_t data_size,
+						char **output_records, size_t *output_size, struct nvram_stats *stats,
+						double *t_start )
+{
+	int file_format = ctx->file_format;
+
+	// JSON is read as a stream, so data already read in is handed to it as one.
+	FILE *f = NULL;
+	if ( !data || ctx->json )
+	{
+		f = data ? fmemopen( data, data_size, "r" ) : compress_open( filename );
+		if ( !f )
+		{
+			int code = errno;
+			char *errstr = strerror( code );
+			fprintf( stderr, "build_file: Error opening %s for input: %s\n", filename, errstr );
+			return -1;
+		}
+	}
+	arena_reset( &ctx->arena );
+	if ( ctx->json )
+	{
+		int record_count = json_file( ctx, f, filename, NULL, output_records, output_size, stats, t_start );
+		if ( ( data ? fclose( f ) : compress_close( f ) ) != 0 )
+		{
+			fprintf( stderr, "build_file: Problem reading %s\n", filename );
+			return -1;
+		}
+		return record_count;
+	}
+
+	// Read the whole file in and then parse it in memory. A lot easier to code
+	// than trying to read chunks from a file and deal with split lines and such.
+	size_t bytes_read = data_size;
+	char *buffer = data;
+	if ( !data )
+	{
+		buffer = arena_read_file( &ctx->arena, f, &bytes_read );
+		if ( compress_close( f ) != 0 )
+			buffer = NULL;
+	}
+	if ( !buffer )
+	{
+		fprintf( stderr, "build_file: Problem reading %s\n", filename );
+		return -1;
+	}
+	stats->bytes_in = bytes_read;
+	stats_phase_end( stats, PHASE_READ, t_start, filename );
+
+	// Split the file into chunks of whole lines, several per thread for -j on
+	// big files and just the one otherwise. A chunk ends just after a newline
+	// that isn't a human-readable line break, or a raw entry's NUL, so no line
+	// spans two chunks.
+	size_t max = ctx->raw ? bytes_read : strlen( buffer );
+	int chunk_count = 1, k;
+	if ( ctx->threads > 1 && max >= PARALLEL_MIN_SIZE )
+		chunk_count = ctx->threads * CHUNKS_PER_THREAD;
+	struct parse_chunk *chunks = arena_alloc( &ctx->arena, chunk_count * sizeof (struct parse_chunk) );
+	if ( !chunks )
+	{
+		fprintf( stderr, "build_file: %s: Out of memory\n", filename );
+		return -1;
+	}
+	char *p = buffer, *p_end = buffer + max;
+	for ( k = 0; k < chunk_count && p < p_end; k++ )
+	{
+		char *end = buffer + max * ( k + 1 ) / chunk_count;
+		if ( k + 1 == chunk_count || end <= p )
+			end = p_end;
+		else if ( ctx->raw )
+		{
+			while ( end < p_end && end[-1] != 0 )
+				end++;
+		}
+		else
+		{
+			while ( end < p_end && ( end[-1] != '\n' || ( end - 2 >= p && end[-2] == '\\' ) ) )
+				end++;
+		}
+		memset( &chunks[k], 0, sizeof (struct parse_chunk) );
+		chunks[k].start = p;
+		chunks[k].end = end;
+		// Every line used has at least two characters, the '=' and the
+		// newline, so there can't be more lines than half the chunk plus one.
+		chunks[k].lines = arena_alloc( &ctx->arena, ( ( end - p ) / 2 + 1 ) * sizeof (struct text_record) );
+		if ( !chunks[k].lines )
+		{
+			fprintf( stderr, "build_file: %s: Out of memory\n", filename );
+			return -1;
+		}
+		p = end;
+	}
+	chunk_count = k;
+
+	// Parse lines out of the chunks into name and value strings.
+	struct parse_job job = { chunks, chunk_count, 0, file_format, ctx->raw };
+	parse_run( ctx->threads, parse_worker, &job );
+	int line_base = 0, line_count = 0;
+	for ( k = 0; k < chunk_count; k++ )
+	{
+		chunks[k].line_base = line_base;
+		line_base += chunks[k].lines_seen;
+		line_count += chunks[k].line_count;
+	}
+	if ( report_errors( filename, chunks, chunk_count ) != 0 )
+	{
+		free_errors( chunks, chunk_count );
+		return -1;
+	}
+	stats_phase_end( stats, PHASE_PARSE, t_start, filename );
+
+	// Unescape our names and values. Unescaping never makes a string longer,
+	// so it's done in place.
+	job.next = 0;
+	parse_run( ctx->threads, unescape_worker, &job );
+	if ( report_errors( filename, chunks, chunk_count ) != 0 )
+	{
+		free_errors( chunks, chunk_count );
+		return -1;
+	}
+	stats_phase_end( stats, PHASE_ESCAPE, t_start, filename );
+
+	// Now to convert the names and values into records. Each chunk's records
+	// go right after the previous chunk's, now that their sizes are known.
+	size_t out_used = 0;
+	int record_count = 0;
+	for ( k = 0; k < chunk_count; k++ )
+		out_used += chunks[k].used;
+	char *output = arena_alloc( &ctx->arena, out_used + 1 );
+	if ( !output )
+	{
+		fprintf( stderr, "build_file: %s: Out of memory\n", filename );
+		free_errors( chunks, chunk_count );
+		return -1;
+	}
+	out_used = 0;
+	for ( k = 0; k < chunk_count; k++ )
+	{
+		chunks[k].output = output + out_used;
+		out_used += chunks[k].used;
+		record_count += chunks[k].stats.records;
+		stats_add( stats, &chunks[k].stats );
+	}
+	job.next = 0;
+	parse_run( ctx->threads, encode_worker, &job );
+	free_errors( chunks, chunk_count );
+
+	*output_records = output;
+	*output_size = out_used;
+	return record_count;
+}
+
+// Writes out the records encode_file() produced and finishes the file's
+// statistics. Returns 0 on success or -1 if an error occurred.
+static int write_records( struct build_context *ctx, FILE *output_file, const char *filename,
+						  const char *output, size_t out_used, struct nvram_stats *stats,
+						  double t_file, double t_start )
+{
+	// Write out all of the records in one go.
+	size_t bytes_written = fwrite( output, sizeof (char), out_used, output_file );
+	if ( bytes_written != out_used )
+	{
+		fprintf( stderr, "build_file: %s: error writing records\n", filename );
+		return -1;
+	}
+	stats->bytes_out = out_used;
+	stats_phase_end( stats, PHASE_OUTPUT, &t_start, filename );
+	trace_span( "build_file", "file", t_file, t_start, filename );
+
+	stats->files = 1;
+	if ( stats_enabled )
+		stats_report( stderr, filename, stats );
+	stats_add( &ctx->total, stats );
 	return 0;
 }
 
+// Builds filename into output_file the way build_file() does when not
+// streaming. If data isn't NULL it's the file's contents, already read in,
+// as encode_file() takes them. Returns the number of records written, or -1
+// if an error occurred.
+static int build_data( struct build_context *ctx, FILE *output_file, const char *filename, char *data,
+					   size_t data_size )
+{
+	struct nvram_stats stats;
+	stats_clear( &stats );
+	double t_file = stats_now(), t_start = t_file;
+	char *output;
+	size_t out_used;
+
+	int record_count = encode_file( ctx, filename, data, data_size, &output, &out_used, &stats, &t_start );
+	if ( record_count < 0 )
+		return -1;
+	if ( write_records( ctx, output_file, filename, output, out_used, &stats, t_file, t_start ) != 0 )
+		return -1;
+	return record_count;
+}
+
 // Returns the number of records written, or -1 if an error occurred.
-int build_file( FILE *output_file, int file_format, const char *filename )
+int build_file( struct build_context *ctx, FILE *output_file, const char *filename )
 {
 	if ( !output_file )
 	{
@@ -125,138 +1391,122 @@ int build_file( FILE *output_file, int file_format, const char *filename )
 		fprintf( stderr, "build_file: No input file given\n" );
 		return -1;
 	}
-	
-	FILE *f = fopen( filename, "rb" );
-	if ( !f )
+	if ( ctx->stream )
+		return build_stream( ctx, output_file, filename );
+
+	return build_data( ctx, output_file, filename, NULL, 0 );
+}
+
+// One input file being built by build_parallel(). Each has its own context
+// so its encoded records stay in its arena until they've been written.
+struct build_result
+{
+	struct build_context ctx;
+	const char *filename;
+	char *output;
+	size_t size;
+	int record_count;		// -1 if the file couldn't be built
+	struct nvram_stats stats;
+	double t_file;
+	double t_start;
+	int finished;
+};
+
+struct build_job
+{
+	struct build_result *results;
+	int count;
+	int next;
+	pthread_mutex_t lock;
+	pthread_cond_t finished;
+};
+
+static void *build_worker( void *arg )
+{
+	struct build_job *job = arg;
+	int i;
+	while ( ( i = __atomic_fetch_add( &job->next, 1, __ATOMIC_RELAXED ) ) < job->count )
 	{
-		int code = errno;
-		char *errstr = strerror( code );
-		fprintf( stderr, "build_file: Error opening %s for input: %s\n", filename, errstr );
-		return -1;
+		struct build_result *r = &job->results[i];
+		stats_clear( &r->stats );
+		r->t_file = stats_now();
+		r->t_start = r->t_file;
+		r->record_count = encode_file( &r->ctx, r->filename, NULL, 0, &r->output, &r->size, &r->stats,
+										&r->t_start );
+
+		pthread_mutex_lock( &job->lock );
+		r->finished = 1;
+		pthread_cond_broadcast( &job->finished );
+		pthread_mutex_unlock( &job->lock );
 	}
-	// Brute-force approach here. Most routers won't have more than 64K or maybe 128K of NVRAM,
-	// so I'm just going to make a 128K static buffer and read the whole file in and then parse
-	// it in memory. That should be sufficient since most backups won't be of a completely-full
-	// NVRAM image. If the input file won't fit, it'll output an error. Not elegant, but a lot
-	// easier to code than trying to read chunks from a file and deal with split lines and such.
-	static char buffer[128*1024 + 1];
-	size_t bytes_read = fread( buffer, sizeof (char), 128*1024+1, f );
-	if ( bytes_read <= ( 128*1024 ) )
+	return NULL;
+}
+
+// Builds count input files on threads worker threads, writing their records
+// to output_file in the order given as each one becomes available. Adds the
+// files' statistics to ctx's totals. Returns the total number of records
+// written, or -1 if any file failed (after trying all of them).
+int build_parallel( struct build_context *ctx, FILE *output_file, char **filenames, int count, int threads )
+{
+	struct build_job job;
+	int i, started = 0, record_count = 0, ret = 0;
+
+	job.results = calloc( count, sizeof (struct build_result) );
+	if ( !job.results )
 	{
-		// Got a complete file
-		buffer[128*1024] = 0;
+		fprintf( stderr, "build_parallel: Out of memory\n" );
+		return -1;
 	}
-	else
+	job.count = count;
+	job.next = 0;
+	pthread_mutex_init( &job.lock, NULL );
+	pthread_cond_init( &job.finished, NULL );
+	for ( i = 0; i < count; i++ )
 	{
-		// File too large or some other error
-		fprintf( stderr, "build_file: Problem reading %s\n", filename );
-		fclose( f );
-		return -1;
+		build_init( &job.results[i].ctx, ctx->file_format );
+		job.results[i].ctx.json = ctx->json;
+		job.results[i].ctx.json_bytes = ctx->json_bytes;
+		job.results[i].ctx.raw = ctx->raw;
+		job.results[i].filename = filenames[i];
 	}
-	fclose( f );
 
-	// Human-readable newlines are a backslash followed by a newline, which is
-	// backslash followed by 'n' in fully-escaped form. So run through the buffer
-	// and make that substitution to avoid complicated code for splicing together
-	// multiple lines.
-	int i, max = strlen( buffer );
-	for ( i = 0; i < max; i++ )
+	pthread_t tids[MAX_THREADS];
+	if ( threads > MAX_THREADS )
+		threads = MAX_THREADS;
+	for ( i = 0; i < threads; i++ )
 	{
-		if ( buffer[i] == '\\' && buffer[i+1] == '\n' )
-			buffer[i+1] = 'n';
+		if ( pthread_create( &tids[started], NULL, build_worker, &job ) != 0 )
+			break;
+		started++;
 	}
+	if ( started == 0 )
+		build_worker( &job ); // No threads, do it all here
 
-	// Parse lines out of the buffer and output them as parameter records, counting
-	// records as we go.
-	static char output_buffer[65536+256+4]; // Build output record here
-	static char r_name[256+1], r_value[65536+1]; // Buffers for unescaping the name and value
-	int record_count = 0, line_number = 0;
-	char *p_start = buffer, *p_end = buffer + strlen( buffer );
-	while ( p_start < p_end )
+	// Write each file's records in order as soon as it's done, and let its
+	// memory go.
+	for ( i = 0; i < count; i++ )
 	{
-		line_number++;
-		char *p_equals = strchr( p_start, '=' );
-		char *p_newline = strchr( p_start, '\n' );
-		if ( !p_newline )
-			p_newline = p_start + strlen( p_start ); // Last line lacks a newline character
-		if ( !p_equals )
-		{
-			// Error, no equals sign on the line
-			fprintf( stderr, "build_file: Line %d: missing equals sign\n", filename, line_number );
-			p_start = p_newline + 1;
-			continue;
-		}
-		// Terminate our parts to give us usable strings.
-		*p_newline = 0;
-		*p_equals = 0;
-		// Convenient names for our name and value strings.
-		char *name = p_start;
-		char *value = p_equals + 1;
-		// And set up past the newline for the next iteration.
-		p_start = p_newline + 1;
-		// Sanity checks.
-		if ( strlen( name ) == 0 )
-		{
-			fprintf( stderr, "build_file: Line %d: name is empty\n", filename, line_number );
-			continue;
-		}
-		// Unescape our name and value.
-		int sts;
-		sts = unescape_string( name, r_name );
-		if ( sts != 0 )
-		{
-			fprintf( stderr, "build_file: Line %d: problem unescaping name\n",
-					 filename, line_number );
-			continue;
-		}
-		sts = unescape_string( value, r_value );
-		if ( sts != 0 )
-		{
-			fprintf( stderr, "build_file: Line %d: problem unescaping value\n",
-					 filename, line_number );
-			continue;
-		}
-		// And use the unescaped forms after this
-		name = r_name;
-		value = r_value;
-		
-		// Now to convert the name and value into a record.
-		int record_len = 0;
-		int len = strlen( name ) & 0xFF; // Only 1 byte for the name length
-		output_buffer[0] = len;
-		strncpy( output_buffer+1, name, len );
-		record_len += len + 1; // Name length plus name
-		int vstart = len+1;
-		int vlen = 0;
-		if ( file_format == FMT_DEFAULTS )
-		{
-			vlen = 1;
-			len = strlen( value ) & 0xFF; // Only 1 byte for the value length
-			output_buffer[vstart] = len;
-			vstart++;
-		}
+		struct build_result *r = &job.results[i];
+		pthread_mutex_lock( &job.lock );
+		while ( !r->finished )
+			pthread_cond_wait( &job.finished, &job.lock );
+		pthread_mutex_unlock( &job.lock );
+
+		if ( r->record_count < 0 ||
+			 write_records( ctx, output_file, r->filename, r->output, r->size, &r->stats,
+							r->t_file, stats_now() ) != 0 )
+			ret = -1;
 		else
-		{
-			vlen = 2;
-			len = strlen( value ) & 0xFFFF; // Only 2 bytes for the value length
-			output_buffer[vstart] = len & 0xFF; // TODO byte ordering
-			output_buffer[vstart+1] = ( len >> 8 ) & 0xFF;
-			vstart += 2;
-		}
-		strncpy( output_buffer+vstart, value, len );
-		record_len += vlen + len; // Value length plus value
-		// And write out our record and count it (we only want to count records we wrote).
-		size_t bytes_written = fwrite( output_buffer, sizeof (char), record_len, output_file );
-		if ( bytes_written != record_len )
-		{
-			fprintf( stderr, "build_file: Line %d: error writing record %d\n",
-					 filename, line_number, record_count+1 );
-			return -1;
-		}
-		record_count++;
+			record_count += r->record_count;
+		build_cleanup( &r->ctx );
 	}
 
-	return record_count;
+	for ( i = 0; i < started; i++ )
+		pthread_join( tids[i], NULL );
+	pthread_cond_destroy( &job.finished );
+	pthread_mutex_destroy( &job.lock );
+	free( job.results );
+	return ret < 0 ? ret : record_count;
 }
 
 int output_header( FILE *output_file, int file_format )
@@ -322,99 +1572,675 @@ int fixup_record_count( FILE *output_file, int file_format, int record_count )
 	return 0;
 }
 
+// Creates filename for output, or uses the standard output if it's "-",
+// compressed in format. Returns NULL if an error occurred.
+static FILE *open_output( const char *filename, int format )
+{
+	FILE *out = strcmp( filename, "-" ) == 0 ? stdout : fopen( filename, "wb" );
+	if ( !out )
+	{
+		int code = errno;
+		char *errstr = strerror( code );
+		fprintf( stderr, "open_output: Error opening %s for output: %s\n", filename, errstr );
+		return NULL;
+	}
+	if ( format == COMPRESS_NONE )
+		return out;
+	FILE *z = compress_writer( out, format );
+	if ( !z )
+	{
+		fprintf( stderr, "open_output: Cannot compress %s: %s\n", filename, strerror( errno ) );
+		fclose( out );
+	}
+	return z;
+}
+
+// Writes a backup built in memory to filename, compressed in format.
+// Returns 0 on success or 1 if an error occurred.
+int write_buffered( const char *data, size_t size, const char *filename, int format )
+{
+	FILE *out = open_output( filename, format );
+	if ( !out )
+		return 1;
+	int ret = fwrite( data, sizeof (char), size, out ) != size;
+	if ( compress_close( out ) != 0 )
+		ret = 1;
+	if ( ret != 0 )
+		fprintf( stderr, "write_buffered: Error writing %s\n", filename );
+	return ret;
+}
+
+// Returns a copy of filename, allocated with malloc(), with its extension
+// replaced by ext, or ext added if it has no extension.
+static char *replace_extension( const char *filename, const char *ext )
+{
+	char *name = malloc( strlen( filename ) + strlen( ext ) + 1 );
+	if ( !name )
+		return NULL;
+	strcpy( name, filename );
+
+	char *p_dot, *p_slash;
+	p_dot = strrchr( name, '.' );
+	p_slash = strrchr( name, '/' );
+	// If we found a dot and either there isn't any slash or the dot occurs
+	// after the slash, we have an extention to replace. Otherwise, we have
+	// no extension and just append our own.
+	if ( p_dot && ( !p_slash || ( p_dot > p_slash ) ) )
+		strcpy( p_dot, ext );
+	else
+		strcat( name, ext );
+	return name;
+}
+
+// Builds each input file into a backup of its own, stored in the tar archive
+// output_filename as the file's name without its directory and with a
+// ".bin" extension. Files that fail are left out. Returns 0 on success or 1
+// if an error occurred.
+int build_tar( struct build_context *ctx, const char *output_filename, char **filenames, int count,
+			   int compress )
+{
+	FILE *out = open_output( output_filename, compress );
+	if ( !out )
+		return 1;
+
+	// The names already used, so two inputs in different directories can't
+	// end up as the same member with the later one hiding the earlier.
+	char **names = calloc( count, sizeof (char *) );
+	const char **sources = calloc( count, sizeof (char *) );
+	if ( !names || !sources )
+	{
+		fprintf( stderr, "build_tar: Out of memory\n" );
+		free( names );
+		free( sources );
+		compress_close( out );
+		return 1;
+	}
+
+	int i, j, named = 0, ret = 0;
+	for ( i = 0; i < count; i++ )
+	{
+		if ( !filenames[i] )
+			continue;
+
+		const char *base = strrchr( filenames[i], '/' );
+		if ( strcmp( filenames[i], "-" ) == 0 )
+			base = "/stdin";
+		char *name = replace_extension( base ? base + 1 : filenames[i], ".bin" );
+		if ( !name )
+		{
+			fprintf( stderr, "build_tar: Out of memory\n" );
+			ret = 1;
+			break;
+		}
+		for ( j = 0; j < named && strcmp( names[j], name ) != 0; j++ )
+			;
+		if ( j < named )
+		{
+			fprintf( stderr, "build_tar: %s and %s would both be stored as %s\n", sources[j], filenames[i], name );
+			free( name );
+			ret = 1;
+			continue;
+		}
+
+		// Each backup is built in memory first, since the record count at the
+		// start and the size in the tar header aren't known until the end.
+		char *data = NULL;
+		size_t size = 0, end = 0;
+		FILE *mem = open_memstream( &data, &size );
+		if ( !mem || output_header( mem, ctx->file_format ) != 0 )
+		{
+			fprintf( stderr, "build_tar: Out of memory\n" );
+			if ( mem )
+				fclose( mem );
+			free( data );
+			free( name );
+			ret = 1;
+			break;
+		}
+		// Seeking back to fix up the count shrinks a memory stream's size to
+		// the position when it's next flushed, so note the full size first.
+		int cnt = build_file( ctx, mem, filenames[i] );
+		if ( cnt >= 0 && fflush( mem ) == 0 )
+			end = size;
+		if ( cnt < 0 || fixup_record_count( mem, ctx->file_format, cnt ) != 0 || fflush( mem ) != 0 )
+		{
+			fclose( mem );
+			free( data );
+			free( name );
+			ret = 1;
+			continue;
+		}
+
+		int sts = 1;
+		if ( tar_write_header( out, name, end ) != 0 ||
+			 fwrite( data, sizeof (char), end, out ) != end || tar_write_pad( out, end ) != 0 )
+			fprintf( stderr, "build_tar: Error writing %s to %s\n", name, output_filename );
+		else
+			sts = 0;
+		names[named] = name;
+		sources[named++] = filenames[i];
+		fclose( mem );
+		free( data );
+		if ( sts != 0 )
+		{
+			ret = 1;
+			break;
+		}
+	}
+	for ( j = 0; j < named; j++ )
+		free( names[j] );
+	free( names );
+	free( sources );
+	if ( tar_write_end( out ) != 0 )
+		ret = 1;
+	if ( compress_close( out ) != 0 )
+	{
+		fprintf( stderr, "build_tar: Error writing %s\n", output_filename );
+		ret = 1;
+	}
+	return ret;
+}
+
+// One parameter of a backup for --patch, pointing into the backup in memory.
+struct patch_entry
+{
+	const char *name;
+	const char *value;
+	unsigned int name_len;
+	unsigned int value_len;
+	unsigned int index;		// Place in the backup, to keep the last of a name
+};
+
+// Orders entries by name, and entries with the same name by their place in
+// the backup.
+static int patch_compare( const void *a, const void *b )
+{
+	const struct patch_entry *x = a, *y = b;
+	unsigned int len = x->name_len < y->name_len ? x->name_len : y->name_len;
+	int cmp = memcmp( x->name, y->name, len );
+	if ( cmp == 0 )
+		cmp = (int) x->name_len - (int) y->name_len;
+	if ( cmp == 0 )
+		cmp = x->index < y->index ? -1 : 1;
+	return cmp;
+}
+
+// Reads the record_count records of the backup in data into *entries,
+// allocated from a, sorted by name with only the last record of each name
+// kept, since that's the value the router ends up with. Names and values
+// end at a NUL, as they do in NVRAM. Returns the number of entries, or -1
+// if the backup is corrupt or there isn't enough memory.
+static int patch_entries( struct arena *a, const char *filename, int file_format, const unsigned char *data,
+						  size_t size, unsigned int record_count, struct patch_entry **entries )
+{
+	size_t len_size = ( file_format == FMT_DEFAULTS ) ? 1 : 2;
+	size_t pos = ( file_format == FMT_DEFAULTS ) ? 4 : 8;
+	struct patch_entry *e = arena_alloc( a, ( record_count + 1 ) * sizeof (struct patch_entry) );
+	if ( !e )
+	{
+		fprintf( stderr, "build_patch: Out of memory\n" );
+		return -1;
+	}
+
+	unsigned int record, count = 0;
+	for ( record = 0; record < record_count; record++ )
+	{
+		size_t name_len = pos < size ? data[pos] : 0;
+		size_t value_pos = pos + 1 + name_len;
+		if ( pos >= size || value_pos + len_size > size )
+		{
+			fprintf( stderr, "build_patch: File %s: Error reading record %u\n", filename, record+1 );
+			return -1;
+		}
+		size_t value_len = read_length( data + value_pos, len_size );
+		if ( value_pos + len_size + value_len > size )
+		{
+			fprintf( stderr, "build_patch: File %s: Error reading value from record %u\n", filename, record+1 );
+			return -1;
+		}
+		e[count].name = (const char *) data + pos + 1;
+		e[count].name_len = strnlen( e[count].name, name_len );
+		e[count].value = (const char *) data + value_pos + len_size;
+		e[count].value_len = strnlen( e[count].value, value_len );
+		e[count].index = record;
+		pos = value_pos + len_size + value_len;
+		// Completely empty records aren't anything.
+		if ( e[count].name_len > 0 || e[count].value_len > 0 )
+			count++;
+	}
+
+	qsort( e, count, sizeof (struct patch_entry), patch_compare );
+	unsigned int i, kept = 0;
+	for ( i = 0; i < count; i++ )
+	{
+		if ( i + 1 < count && e[i].name_len == e[i+1].name_len &&
+			 memcmp( e[i].name, e[i+1].name, e[i].name_len ) == 0 )
+			continue;
+		e[kept++] = e[i];
+	}
+	*entries = e;
+	return kept;
+}
+
+// Writes s as part of a single-quoted shell word, which keeps every byte as
+// it is except the quote itself.
+static void patch_quote( FILE *out, const char *s, size_t len )
+{
+	const char *quote;
+	while ( ( quote = memchr( s, '\'', len ) ) != NULL )
+	{
+		fwrite( s, sizeof (char), quote - s, out );
+		fputs( "'\\''", out );
+		len -= quote - s + 1;
+		s = quote + 1;
+	}
+	fwrite( s, sizeof (char), len, out );
+}
+
+// Writes the nvram command that sets or unsets entry e. Names nvram can't
+// take, empty ones or ones containing an '=', are skipped with a warning.
+// Returns 1 if a command was written, 0 if not.
+static int patch_command( FILE *out, const struct patch_entry *e, int set )
+{
+	if ( e->name_len == 0 || memchr( e->name, '=', e->name_len ) )
+	{
+		fprintf( stderr, "build_patch: Entry %.*s: Name can't be given to nvram, skipped\n",
+				 (int) e->name_len, e->name );
+		return 0;
+	}
+	fputs( set ? "nvram set '" : "nvram unset '", out );
+	patch_quote( out, e->name, e->name_len );
+	if ( set )
+	{
+		fputc( '=', out );
+		patch_quote( out, e->value, e->value_len );
+	}
+	fputs( "'\n", out );
+	return 1;
+}
+
+// Reads filename into a for --patch. Returns its data, NUL-terminated, with
+// its size in *size, or NULL if it can't be read.
+static unsigned char *patch_read( struct arena *a, const char *filename, size_t *size )
+{
+	FILE *f = compress_open( filename );
+	if ( !f )
+	{
+		fprintf( stderr, "build_patch: Error opening %s: %s\n", filename, strerror( errno ) );
+		return NULL;
+	}
+	unsigned char *data = (unsigned char *) arena_read_file( a, f, size );
+	if ( compress_close( f ) != 0 )
+		data = NULL;
+	if ( !data )
+	{
+		fprintf( stderr, "build_patch: File %s: Error reading file\n", filename );
+		return NULL;
+	}
+	return data;
+}
+
+// Checks that data, size bytes read from filename, starts with a backup
+// header and puts its record count in *record_count. Returns 0 if it does
+// or 1 if not. If quiet is set, nothing is reported if it doesn't.
+static int patch_header( const char *filename, int file_format, int quiet, const unsigned char *data,
+						 size_t size, unsigned int *record_count )
+{
+	size_t header_size = ( file_format == FMT_DEFAULTS ) ? 4 : 8;
+	if ( size < header_size || ( file_format != FMT_DEFAULTS && memcmp( data, "DD-WRT", 6 ) != 0 ) )
+	{
+		if ( !quiet )
+			fprintf( stderr, "build_patch: File %s: Error reading header and record count\n", filename );
+		return 1;
+	}
+	*record_count = read_record_count( file_format, data );
+	return 0;
+}
+
+// Builds the input files into a backup in memory and writes the nvram
+// commands that turn the backup in current into it to output_filename as a
+// shell script: an "nvram set" for every entry that's new or different, an
+// "nvram unset" for every entry that's gone, and one "nvram commit" at the
+// end if there were any. A single input file that's a backup already, not
+// the standard input, is used as it is; that can't be told with -d, since
+// the defaults format has nothing to recognize it by. Returns 0 on success
+// or 1 if an error occurred.
+int build_patch( struct build_context *ctx, const char *current, const char *output_filename,
+				 char **filenames, int count, int compress )
+{
+	int file_format = ctx->file_format;
+	struct arena a;
+	arena_init( &a, ARENA_BLOCK_SIZE );
+
+	// The backup that's on the router now
+	size_t current_size = 0;
+	unsigned int current_count = 0;
+	unsigned char *current_data = patch_read( &a, current, &current_size );
+	if ( !current_data || patch_header( current, file_format, 0, current_data, current_size, &current_count ) != 0 )
+	{
+		arena_free( &a );
+		return 1;
+	}
+
+	// The backup it should become, either given or built the usual way
+	// A single input file is read just once, and if it isn't a backup what
+	// was read is what gets built.
+	const char *want_name = filenames[0];
+	unsigned char *want_data = NULL, *input = NULL;
+	size_t want_size = 0, input_size = 0;
+	unsigned int want_records = 0;
+	char *data = NULL;
+	size_t size = 0;
+	FILE *mem = NULL;
+	int i, ret = 0;
+	if ( count == 1 && strcmp( want_name, "-" ) != 0 )
+	{
+		input = patch_read( &a, want_name, &input_size );
+		if ( !input )
+			ret = 1;
+		else if ( file_format != FMT_DEFAULTS &&
+				  patch_header( want_name, file_format, 1, input, input_size, &want_records ) == 0 )
+		{
+			want_data = input;
+			want_size = input_size;
+		}
+	}
+	if ( !want_data && ret == 0 )
+	{
+		want_name = "(built)";
+		mem = open_memstream( &data, &size );
+		if ( !mem || output_header( mem, file_format ) != 0 )
+		{
+			fprintf( stderr, "build_patch: Out of memory\n" );
+			ret = 1;
+		}
+		for ( i = 0; i < count && ret == 0; i++ )
+		{
+			if ( !filenames[i] )
+				continue;
+			int cnt;
+			if ( input )
+				cnt = build_data( ctx, mem, filenames[i], (char *) input, input_size );
+			else
+				cnt = build_file( ctx, mem, filenames[i] );
+			if ( cnt < 0 )
+				ret = 1;
+			else
+				want_records += cnt;
+		}
+		if ( mem && fflush( mem ) != 0 )
+			ret = 1;
+		want_data = (unsigned char *) data;
+		want_size = size;
+	}
+
+	struct patch_entry *have = NULL, *want = NULL;
+	int have_count = 0, want_count = 0;
+	if ( ret == 0 )
+	{
+		have_count = patch_entries( &a, current, file_format, current_data, current_size, current_count, &have );
+		want_count = patch_entries( &a, want_name, file_format, want_data, want_size, want_records, &want );
+		if ( have_count < 0 || want_count < 0 )
+			ret = 1;
+	}
+
+	// Both lists are in name order, so one pass through them together finds
+	// every difference.
+	FILE *out = ret == 0 ? open_output( output_filename, compress ) : NULL;
+	if ( out )
+	{
+		int h = 0, w = 0, changes = 0;
+		while ( h < have_count || w < want_count )
+		{
+			int cmp;
+			if ( h == have_count )
+				cmp = 1;
+			else if ( w == want_count )
+				cmp = -1;
+			else
+			{
+				unsigned int len = have[h].name_len < want[w].name_len ? have[h].name_len : want[w].name_len;
+				cmp = memcmp( have[h].name, want[w].name, len );
+				if ( cmp == 0 )
+					cmp = (int) have[h].name_len - (int) want[w].name_len;
+			}
+			if ( cmp < 0 )
+				changes += patch_command( out, &have[h++], 0 );
+			else if ( cmp > 0 )
+				changes += patch_command( out, &want[w++], 1 );
+			else
+			{
+				if ( have[h].value_len != want[w].value_len ||
+					 memcmp( have[h].value, want[w].value, want[w].value_len ) != 0 )
+					changes += patch_command( out, &want[w], 1 );
+				h++;
+				w++;
+			}
+		}
+		if ( changes > 0 )
+			fputs( "nvram commit\n", out );
+		if ( compress_close( out ) != 0 )
+		{
+			fprintf( stderr, "build_patch: Error writing %s\n", output_filename );
+			ret = 1;
+		}
+	}
+	else
+		ret = 1;
+
+	if ( mem )
+		fclose( mem );
+	free( data );
+	arena_free( &a );
+	return ret;
+}
+
 int main( int argc, char **argv )
 {
 	// If no -o option is given, we default to the base name of the first
 	// input file plus ".bin".
-	char output_filename[65541]; // Length is 64K for string + 4 for possible extention + 1 for terminating NUL
+	char *output_filename = NULL;
 
 	int file_format = FMT_NVRAM;
+	int stream = DEFAULT_STREAM;
+	int threads = 1;
+	int compress = -1;
+	int tar = 0;
+	int json = 0;
+	int json_bytes = 0;
+	int raw = 0;
+	char *patch = NULL;
 
-	memset( output_filename, 0, 65541 );
+	stats_escape_name = "unescape";
 	
 	// Check our arguments for options, and for at least one filename after
 	// the options.
+	static const struct option long_options[] =
+	{
+		{ "stats", no_argument, NULL, OPT_STATS },
+		{ "trace", required_argument, NULL, OPT_TRACE },
+		{ "stream", no_argument, NULL, OPT_STREAM },
+		{ "compress", required_argument, NULL, OPT_COMPRESS },
+		{ "tar", no_argument, NULL, OPT_TAR },
+		{ "json", no_argument, NULL, OPT_JSON },
+		{ "json-bytes", no_argument, NULL, OPT_JSON_BYTES },
+		{ "patch", required_argument, NULL, OPT_PATCH },
+		{ NULL, 0, NULL, 0 }
+	};
 	int opt;
-	while ( ( opt = getopt( argc, argv, "do:" ) ) != -1 )
+	while ( ( opt = getopt_long( argc, argv, "do:j:0", long_options, NULL ) ) != -1 )
 	{
-		switch ( (char) opt )
+		switch ( opt )
 		{
+		case '0':
+			raw = 1;
+			break;
+
 		case 'o':
-			strncpy( output_filename, optarg, 65536 );
-			output_filename[65536] = 0;
+			free( output_filename );
+			output_filename = strdup( optarg );
 			break;
 
 		case 'd':
 			file_format = FMT_DEFAULTS;
 			break;
 
+		case 'j':
+			threads = atoi( optarg );
+			if ( threads < 1 || threads > MAX_THREADS )
+			{
+				fprintf( stderr, "Thread count for -j must be from 1 to %d\n", MAX_THREADS );
+				return 1;
+			}
+			break;
+
+		case OPT_STATS:
+			stats_enabled = 1;
+			break;
+
+		case OPT_STREAM:
+			stream = 1;
+			break;
+
+		case OPT_TAR:
+			tar = 1;
+			break;
+
+		case OPT_JSON:
+			json = 1;
+			break;
+
+		case OPT_JSON_BYTES:
+			json = 1;
+			json_bytes = 1;
+			break;
+
+		case OPT_PATCH:
+			patch = optarg;
+			break;
+
+		case OPT_COMPRESS:
+			compress = compress_format( optarg );
+			if ( compress < 0 )
+			{
+				fprintf( stderr, "Compression format %s is not supported\n", optarg );
+				return 1;
+			}
+			break;
+
+		case OPT_TRACE:
+			// Every exit after this point, including the error returns,
+			// has to finish the trace or it's left as unterminated JSON.
+			if ( trace_open( optarg ) != 0 )
+				return 1;
+			atexit( trace_close );
+			break;
+
 		default:
-			fprintf( stderr, "Usage: %s [-o <output_filename>] [-d] <filename>...\n", argv[0] );
+			fprintf( stderr, "Usage: %s [-o <output_filename>] [-d] [-0] [-j <threads>] [--stats] [--trace=<trace_file>] [--stream] [--compress=<format>] [--tar] [--json] [--json-bytes] [--patch=<current>] <filename>...\n", argv[0] );
 			return 1;
 		}
 	}
 	if ( optind >= argc )
 	{
 		fprintf( stderr, "Expected at least one input file\n" );
-		fprintf( stderr, "Usage: %s [-o <output_filename>] [-d] <filename>...\n", argv[0] );
+		fprintf( stderr, "Usage: %s [-o <output_filename>] [-d] [-0] [-j <threads>] [--stats] [--trace=<trace_file>] [--stream] [--compress=<format>] [--tar] [--json] [--json-bytes] [--patch=<current>] <filename>...\n", argv[0] );
+		return 1;
+	}
+	if ( json && raw )
+	{
+		fprintf( stderr, "Input can't be both JSON and raw entries\n" );
+		return 1;
+	}
+	if ( patch && tar )
+	{
+		fprintf( stderr, "Output can't be both a patch and a tar archive\n" );
 		return 1;
 	}
 
 	int i;
 
 	// If we weren't given an output filename, find the first input file and
-	// we'll use it's name as a base for an output filename.
-	if ( strlen( output_filename ) == 0 )
+	// we'll use it's name as a base for an output filename, changing its
+	// extension to ".bin" (or ".tar" with --tar). Input from the standard
+	// input goes to the standard output, and so does a patch.
+	if ( !output_filename && patch )
+		output_filename = strdup( "-" );
+	if ( !output_filename )
 	{
 		for ( i = optind; i < argc; i++ )
 		{
 			if ( argv[i] )
 			{
-				strncpy( output_filename, argv[i], 65536 );
-				output_filename[65536] = 0;
+				// Reading the standard input, write to the standard output.
+				if ( strcmp( argv[i], "-" ) == 0 )
+					output_filename = strdup( "-" );
+				else
+					output_filename = replace_extension( argv[i], tar ? ".tar" : ".bin" );
 				break;
 			}
 		}
-
-		// Change the filename's extension to ".bin", or add ".bin" if
-		// the file didn't have an extension.
-		char *p_dot, *p_slash;
-		p_dot = strrchr( output_filename, '.' );
-		p_slash = strrchr( output_filename, '/' );
-		// If we found a dot and either there isn't any slash or the dot occurs
-		// after the slash, we have an extention to replace. Otherwise, we have
-		// no extension and just append our own.
-		if ( p_dot && ( !p_slash || ( p_dot > p_slash ) ) )
+		if ( !output_filename )
 		{
-			// We have an extension in the trailing path segment, replace it with ".bin".
-			// Due to our extra length we will always have room for 4 extra characters.
-			strcpy( p_dot, ".bin" );
+			fprintf( stderr, "main: Out of memory\n" );
+			return 1;
 		}
-		else
+	}
+
+	// Without --compress, an output filename ending in .gz or .zst is
+	// compressed to match.
+	if ( compress < 0 )
+	{
+		compress = compress_format_of( output_filename );
+		if ( compress < 0 )
 		{
-			// No extension seen in the trailing path segment, append ".bin".
-			// Due to our extra length we will always have room for 4 extra characters.
-			strcat( output_filename, ".bin" );
+			fprintf( stderr, "main: Compressed output %s is not supported\n", output_filename );
+			free( output_filename );
+			return 1;
 		}
 	}
 
+	// Output that can't be rewound to fill in the record count at the end,
+	// the standard output or anything compressed, is built in memory first.
+	int buffered = compress != COMPRESS_NONE || strcmp( output_filename, "-" ) == 0;
+	char *buffer = NULL;
+	size_t buffer_size = 0;
+
 	// Build output from files given. If any file fails, we fail.
+	struct build_context ctx;
 	FILE *f = NULL;
 	int record_count = 0;
 	int ret = 0, sts;
-	for ( i = optind; i < argc; i++ )
+	build_init( &ctx, file_format );
+	ctx.stream = stream;
+	ctx.json = json;
+	ctx.json_bytes = json_bytes;
+	ctx.raw = raw;
+	ctx.threads = threads;
+	if ( tar )
+	{
+		// Each input file becomes a backup of its own in the archive.
+		ret = build_tar( &ctx, output_filename, argv + optind, argc - optind, compress );
+	}
+	else if ( patch )
+	{
+		// The input files together are what the router should end up with.
+		ret = build_patch( &ctx, patch, output_filename, argv + optind, argc - optind, compress );
+	}
+	else for ( i = optind; i < argc; i++ )
 	{
 		if ( argv[i] )
 		{
 			// Open the file the first time we have something to output.
 			if ( !f )
 			{
-				f = fopen( output_filename, "wb" );
+				f = buffered ? open_memstream( &buffer, &buffer_size ) : fopen( output_filename, "wb" );
 				if ( !f )
 				{
 					int code = errno;
 					char *errstr = strerror( code );
 					fprintf( stderr, "main: Error opening %s for output: %s\n", output_filename, errstr );
+					free( output_filename );
 					return 1;
 				}
 				sts = output_header( f, file_format );
@@ -425,8 +2251,19 @@ int main( int argc, char **argv )
 				}
 			}
 
+			// With more than one thread, all of the files are built together.
+			if ( threads > 1 && !stream && argc - i > 1 )
+			{
+				int cnt = build_parallel( &ctx, f, argv + i, argc - i, threads );
+				if ( cnt < 0 )
+					ret = 1;
+				else
+					record_count += cnt;
+				break;
+			}
+
 			int cnt;
-			cnt = build_file( f, file_format, argv[i] );
+			cnt = build_file( &ctx, f, argv[i] );
 			if ( cnt < 0 )
 				ret = 1;
 			else
@@ -435,6 +2272,15 @@ int main( int argc, char **argv )
 	}
 	if ( f )
 	{
+		// Seeking back to fix up the count shrinks a memory stream's size to
+		// the position when it's next flushed, so note the full size first.
+		size_t buffer_end = 0;
+		if ( ret == 0 && buffered )
+		{
+			if ( fflush( f ) != 0 )
+				ret = 1;
+			buffer_end = buffer_size;
+		}
 		if ( ret == 0 )
 		{
 			sts = fixup_record_count( f, file_format, record_count );
@@ -444,7 +2290,20 @@ int main( int argc, char **argv )
 				ret = 1;
 			}
 		}
+		if ( ret == 0 && buffered )
+		{
+			if ( fflush( f ) != 0 )
+				ret = 1;
+			else
+				ret = write_buffered( buffer, buffer_end, output_filename, compress );
+		}
 		fclose( f );
+		free( buffer );
 	}
+	if ( stats_enabled )
+		stats_report( stderr, NULL, &ctx.total );
+	build_cleanup( &ctx );
+	free( output_filename );
+	trace_close();
 	return ret;
 }
@@ -0,0 +1,647 @@
+// nvram_compress.c
+// Copyright 2015, Todd Knarr <tknarr@silverglass.org>
+// Licensed under the terms of the GPL v3 or any later version.
+// See LICENSE.md for complete license terms.
+
+//	  This program is free software: you can redistribute it and/or modify
+//	  it under the terms of the GNU General Public License as published by
+//	  the Free Software Foundation, either version 3 of the License, or
+//	  (at your option) any later version.
+
+//	  This program is distributed in the hope that it will be useful,
+//	  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+//	  GNU General Public License for more details.
+
+//	  You should have received a copy of the GNU General Public License
+//	  along with this program.	If not, see <http://www.gnu.org/licenses/>.
+
+// Compressed streams are run through a socket pair: a thread owns the real
+// file and the codec, and the caller gets an ordinary FILE for the other end
+// of the socket. That way every reader and writer in the tools works on
+// compressed data unchanged, and decompression runs alongside parsing. A
+// socket is used rather than a pipe so the thread can send with
+// MSG_NOSIGNAL and simply stop if the caller closes its end early.
+// gzip support needs zlib (HAVE_ZLIB), zstd support needs libzstd
+// (HAVE_ZSTD).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "nvram_arena.h"
+#include "nvram_compress.h"
+
+// Size of the codecs' input and output buffers.
+#define CODEC_CHUNK		( 64*1024 )
+
+static const char *format_names[] = { "uncompressed", "gzip", "zstd" };
+
+// One compressed stream being handled by a thread.
+struct compress_stream
+{
+	FILE *f;				// The caller's end
+	int format;
+	int fd;					// The thread's end of the socket pair
+	FILE *file;				// The real file, owned by the thread
+	unsigned char prefix[UNREAD_MAX];	// Bytes already read to detect the format
+	size_t prefix_len;
+	const char *filename;	// For messages, NULL for output
+	int error;
+	pthread_t thread;
+	struct compress_stream *next;
+};
+
+static struct compress_stream *streams = NULL;
+static pthread_mutex_t streams_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int format_supported( int format )
+{
+	switch ( format )
+	{
+	case COMPRESS_NONE:
+		return 1;
+#ifdef HAVE_ZLIB
+	case COMPRESS_GZIP:
+		return 1;
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+int compress_format( const char *name )
+{
+	int format;
+	if ( strcmp( name, "none" ) == 0 )
+		format = COMPRESS_NONE;
+	else if ( strcmp( name, "gzip" ) == 0 || strcmp( name, "gz" ) == 0 )
+		format = COMPRESS_GZIP;
+	else if ( strcmp( name, "zstd" ) == 0 || strcmp( name, "zst" ) == 0 )
+		format = COMPRESS_ZSTD;
+	else
+		return -1;
+	return format_supported( format ) ? format : -1;
+}
+
+int compress_format_of( const char *filename )
+{
+	size_t len = strlen( filename );
+	int format = COMPRESS_NONE;
+	if ( len > 3 && strcmp( filename + len - 3, ".gz" ) == 0 )
+		format = COMPRESS_GZIP;
+	else if ( len > 4 && strcmp( filename + len - 4, ".zst" ) == 0 )
+		format = COMPRESS_ZSTD;
+	return format_supported( format ) ? format : -1;
+}
+
+int compress_detect( const unsigned char *data, size_t size )
+{
+	if ( size >= 2 && data[0] == 0x1F && data[1] == 0x8B )
+		return COMPRESS_GZIP;
+	if ( size >= 4 && data[0] == 0x28 && data[1] == 0xB5 && data[2] == 0x2F && data[3] == 0xFD )
+		return COMPRESS_ZSTD;
+	return COMPRESS_NONE;
+}
+
+// Compressed input: some bytes already in memory, then the rest of a file
+// if there is one.
+struct source
+{
+	const unsigned char *data;
+	size_t size;
+	size_t pos;
+	FILE *f;
+};
+
+static size_t source_read( struct source *s, unsigned char *buffer, size_t len )
+{
+	if ( s->pos < s->size )
+	{
+		size_t n = s->size - s->pos;
+		if ( n > len )
+			n = len;
+		memcpy( buffer, s->data + s->pos, n );
+		s->pos += n;
+		return n;
+	}
+	return s->f ? fread( buffer, sizeof (char), len, s->f ) : 0;
+}
+
+// Where decompressed data goes. Returns non-zero to stop decoding.
+typedef int (*sink_fn)( void *arg, const unsigned char *data, size_t len );
+
+// Decompresses everything from src into sink. Returns 0 on success, 1 if the
+// sink stopped it, or -1 if the data is corrupt or truncated.
+static int decode( int format, struct source *src, sink_fn sink, void *arg )
+{
+	unsigned char in[CODEC_CHUNK], out[CODEC_CHUNK];
+	size_t n;
+	(void) out;
+
+	if ( format == COMPRESS_NONE )
+	{
+		while ( ( n = source_read( src, in, sizeof in ) ) > 0 )
+		{
+			if ( sink( arg, in, n ) != 0 )
+				return 1;
+		}
+		return 0;
+	}
+#ifdef HAVE_ZLIB
+	if ( format == COMPRESS_GZIP )
+	{
+		z_stream z;
+		memset( &z, 0, sizeof z );
+		if ( inflateInit2( &z, 15 + 32 ) != Z_OK )
+			return -1;
+		// Output can still be pending inside zlib after the input runs out,
+		// so only read more when the last call didn't fill the output.
+		int sts = 0, ended = 0, full = 0;
+		for ( ;; )
+		{
+			if ( z.avail_in == 0 && !full )
+			{
+				n = source_read( src, in, sizeof in );
+				if ( n == 0 )
+					break;
+				z.next_in = in;
+				z.avail_in = n;
+			}
+			z.next_out = out;
+			z.avail_out = sizeof out;
+			int ret = inflate( &z, Z_NO_FLUSH );
+			if ( ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR || ret == Z_STREAM_ERROR )
+			{
+				sts = -1;
+				break;
+			}
+			full = ( z.avail_out == 0 );
+			if ( z.avail_out < sizeof out && sink( arg, out, sizeof out - z.avail_out ) != 0 )
+			{
+				sts = 1;
+				break;
+			}
+			if ( ret == Z_STREAM_END )
+			{
+				// gzip files can be several members one after another.
+				ended = 1;
+				inflateReset( &z );
+			}
+			else if ( ret == Z_OK )
+				ended = 0;
+		}
+		if ( sts == 0 && !ended )
+			sts = -1;
+		inflateEnd( &z );
+		return sts;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	if ( format == COMPRESS_ZSTD )
+	{
+		ZSTD_DStream *zd = ZSTD_createDStream();
+		if ( !zd )
+			return -1;
+		ZSTD_initDStream( zd );
+		ZSTD_inBuffer zin = { in, 0, 0 };
+		size_t remaining = 1;
+		int sts = 0, full = 0;
+		for ( ;; )
+		{
+			if ( zin.pos == zin.size && !full )
+			{
+				n = source_read( src, in, sizeof in );
+				if ( n == 0 )
+					break;
+				zin.size = n;
+				zin.pos = 0;
+			}
+			ZSTD_outBuffer zout = { out, sizeof out, 0 };
+			remaining = ZSTD_decompressStream( zd, &zout, &zin );
+			if ( ZSTD_isError( remaining ) )
+			{
+				sts = -1;
+				break;
+			}
+			full = ( zout.pos == zout.size );
+			if ( zout.pos > 0 && sink( arg, out, zout.pos ) != 0 )
+			{
+				sts = 1;
+				break;
+			}
+		}
+		// Zero means the last frame was complete.
+		if ( sts == 0 && remaining != 0 )
+			sts = -1;
+		ZSTD_freeDStream( zd );
+		return sts;
+	}
+#endif
+	return -1;
+}
+
+// Reads from fd until it's closed and writes it compressed to out. Returns
+// 0 on success, non-zero on an error.
+static int encode( int format, int fd, FILE *out )
+{
+	unsigned char in[CODEC_CHUNK], buffer[CODEC_CHUNK];
+	ssize_t n;
+	int sts = 0;
+	(void) buffer;
+
+#ifdef HAVE_ZLIB
+	z_stream z;
+	if ( format == COMPRESS_GZIP )
+	{
+		memset( &z, 0, sizeof z );
+		if ( deflateInit2( &z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+			return 1;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *zc = NULL;
+	if ( format == COMPRESS_ZSTD )
+	{
+		zc = ZSTD_createCCtx();
+		if ( !zc )
+			return 1;
+	}
+#endif
+
+	do
+	{
+		n = read( fd, in, sizeof in );
+		if ( n < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+			sts = 1;
+			break;
+		}
+		if ( format == COMPRESS_NONE )
+		{
+			if ( fwrite( in, sizeof (char), n, out ) != (size_t) n )
+				sts = 1;
+		}
+#ifdef HAVE_ZLIB
+		else if ( format == COMPRESS_GZIP )
+		{
+			z.next_in = in;
+			z.avail_in = n;
+			do
+			{
+				z.next_out = buffer;
+				z.avail_out = sizeof buffer;
+				deflate( &z, n == 0 ? Z_FINISH : Z_NO_FLUSH );
+				size_t have = sizeof buffer - z.avail_out;
+				if ( fwrite( buffer, sizeof (char), have, out ) != have )
+					sts = 1;
+			} while ( z.avail_out == 0 && sts == 0 );
+		}
+#endif
+#ifdef HAVE_ZSTD
+		else if ( format == COMPRESS_ZSTD )
+		{
+			ZSTD_inBuffer zin = { in, n, 0 };
+			ZSTD_EndDirective mode = n == 0 ? ZSTD_e_end : ZSTD_e_continue;
+			size_t remaining;
+			do
+			{
+				ZSTD_outBuffer zout = { buffer, sizeof buffer, 0 };
+				remaining = ZSTD_compressStream2( zc, &zout, &zin, mode );
+				if ( ZSTD_isError( remaining ) )
+				{
+					sts = 1;
+					break;
+				}
+				if ( fwrite( buffer, sizeof (char), zout.pos, out ) != zout.pos )
+					sts = 1;
+			} while ( sts == 0 && ( mode == ZSTD_e_end ? remaining != 0 : zin.pos < zin.size ) );
+		}
+#endif
+	} while ( n != 0 && sts == 0 );
+
+#ifdef HAVE_ZLIB
+	if ( format == COMPRESS_GZIP )
+		deflateEnd( &z );
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_freeCCtx( zc );
+#endif
+	return sts;
+}
+
+// Sends decompressed data to the caller's end of the socket. Stops quietly
+// if the caller has closed it.
+static int socket_sink( void *arg, const unsigned char *data, size_t len )
+{
+	int fd = *(int *) arg;
+	while ( len > 0 )
+	{
+		ssize_t n = send( fd, data, len, MSG_NOSIGNAL );
+		if ( n < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+			return 1;
+		}
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void *decode_thread( void *arg )
+{
+	struct compress_stream *s = arg;
+	struct source src = { s->prefix, s->prefix_len, 0, s->file };
+	int sts = decode( s->format, &src, socket_sink, &s->fd );
+	if ( ferror( s->file ) )
+	{
+		fprintf( stderr, "compress: %s: Error reading file\n", s->filename );
+		s->error = 1;
+	}
+	else if ( sts < 0 )
+	{
+		fprintf( stderr, "compress: %s: Corrupt or truncated %s data\n", s->filename,
+				 format_names[s->format] );
+		s->error = 1;
+	}
+	close( s->fd );
+	if ( compress_close( s->file ) != 0 )
+		s->error = 1;
+	return NULL;
+}
+
+static void *encode_thread( void *arg )
+{
+	struct compress_stream *s = arg;
+	char scratch[4096];
+	if ( encode( s->format, s->fd, s->file ) != 0 )
+	{
+		fprintf( stderr, "compress: Error writing %s output\n", format_names[s->format] );
+		s->error = 1;
+		// Keep taking what the caller writes so it never sees a broken pipe.
+		while ( read( s->fd, scratch, sizeof scratch ) > 0 )
+			;
+	}
+	close( s->fd );
+	if ( fclose( s->file ) != 0 )
+		s->error = 1;
+	return NULL;
+}
+
+// Sets up a socket pair and the thread for file. Returns the stream with
+// s->f set to the caller's end, or NULL with errno set. On failure file is
+// left open.
+static struct compress_stream *start_stream( FILE *file, int format, int writing, const char *filename,
+											 const unsigned char *prefix, size_t prefix_len )
+{
+	int fds[2];
+	struct compress_stream *s = calloc( 1, sizeof (struct compress_stream) );
+	if ( !s )
+		return NULL;
+	if ( socketpair( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds ) != 0 )
+	{
+		free( s );
+		return NULL;
+	}
+	s->format = format;
+	s->fd = fds[1];
+	s->file = file;
+	s->filename = filename;
+	if ( prefix_len )
+		memcpy( s->prefix, prefix, prefix_len );
+	s->prefix_len = prefix_len;
+	s->f = fdopen( fds[0], writing ? "wb" : "rb" );
+	if ( !s->f )
+	{
+		close( fds[0] );
+		close( fds[1] );
+		free( s );
+		return NULL;
+	}
+	if ( pthread_create( &s->thread, NULL, writing ? encode_thread : decode_thread, s ) != 0 )
+	{
+		fclose( s->f );
+		close( fds[1] );
+		free( s );
+		errno = EAGAIN;
+		return NULL;
+	}
+	pthread_mutex_lock( &streams_lock );
+	s->next = streams;
+	streams = s;
+	pthread_mutex_unlock( &streams_lock );
+	return s;
+}
+
+// Closes a file compress_open() was given, but leaves the standard input
+// open, since it's still the caller's.
+static void close_input( FILE *f )
+{
+	if ( f != stdin )
+		fclose( f );
+}
+
+FILE *compress_open( const char *filename )
+{
+	FILE *f = strcmp( filename, "-" ) == 0 ? stdin : fopen( filename, "rb" );
+	if ( !f )
+		return NULL;
+
+	unsigned char prefix[4];
+	size_t n = fread( prefix, sizeof (char), sizeof prefix, f );
+	if ( ferror( f ) )
+	{
+		int code = errno;
+		close_input( f );
+		errno = code;
+		return NULL;
+	}
+	int format = compress_detect( prefix, n );
+	if ( format == COMPRESS_NONE && fseek( f, -(long) n, SEEK_CUR ) == 0 )
+		return f;
+	if ( !format_supported( format ) )
+	{
+		close_input( f );
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+	// Uncompressed data that can't be rewound is passed through the thread
+	// with the bytes already read put back in front.
+	struct compress_stream *s = start_stream( f, format, 0, filename, prefix, n );
+	if ( !s )
+	{
+		int code = errno;
+		close_input( f );
+		errno = code;
+		return NULL;
+	}
+	return s->f;
+}
+
+FILE *compress_unread( FILE *f, const char *filename, const unsigned char *data, size_t len )
+{
+	if ( len > UNREAD_MAX )
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	if ( fseek( f, -(long) len, SEEK_CUR ) == 0 )
+		return f;
+	struct compress_stream *s = start_stream( f, COMPRESS_NONE, 0, filename, data, len );
+	return s ? s->f : NULL;
+}
+
+FILE *compress_writer( FILE *out, int format )
+{
+	if ( !format_supported( format ) )
+	{
+		errno = ENOTSUP;
+		return NULL;
+	}
+	struct compress_stream *s = start_stream( out, format, 1, NULL, NULL, 0 );
+	return s ? s->f : NULL;
+}
+
+int compress_stdout( int format )
+{
+	if ( !format_supported( format ) )
+	{
+		errno = ENOTSUP;
+		return 1;
+	}
+	fflush( stdout );
+	int out = dup( STDOUT_FILENO );
+	FILE *file = out >= 0 ? fdopen( out, "wb" ) : NULL;
+	if ( !file )
+	{
+		if ( out >= 0 )
+			close( out );
+		return 1;
+	}
+	struct compress_stream *s = start_stream( file, format, 1, NULL, NULL, 0 );
+	if ( !s )
+	{
+		fclose( file );
+		return 1;
+	}
+	// Swap the socket in as file descriptor 1 underneath stdout.
+	int fd = fileno( s->f );
+	if ( dup2( fd, STDOUT_FILENO ) < 0 )
+	{
+		compress_close( s->f );
+		return 1;
+	}
+	// Close our own copy without closing the descriptor's socket underneath
+	// stdout, then stdout stands in for it.
+	fclose( s->f );
+	s->f = stdout;
+	return 0;
+}
+
+int compress_close( FILE *f )
+{
+	struct compress_stream *s, **link;
+	pthread_mutex_lock( &streams_lock );
+	for ( link = &streams; ( s = *link ) != NULL; link = &s->next )
+	{
+		if ( s->f == f )
+		{
+			*link = s->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock( &streams_lock );
+	if ( !s )
+		return fclose( f ) != 0;
+
+	int ret = 0;
+	if ( f == stdout )
+	{
+		// Closing descriptor 1 is what tells the thread the output is done.
+		if ( fflush( stdout ) != 0 )
+			ret = 1;
+		close( STDOUT_FILENO );
+	}
+	else if ( fclose( f ) != 0 )
+		ret = 1;
+	pthread_join( s->thread, NULL );
+	if ( s->error )
+		ret = 1;
+	free( s );
+	return ret;
+}
+
+// Collects decompressed data in arena memory for compress_decode().
+struct arena_sink
+{
+	struct arena *a;
+	char *buffer;
+	size_t used;
+	size_t allocated;
+};
+
+static int arena_sink( void *arg, const unsigned char *data, size_t len )
+{
+	struct arena_sink *s = arg;
+	if ( s->used + len + 1 > s->allocated )
+	{
+		size_t allocated = s->allocated * 2;
+		while ( s->used + len + 1 > allocated )
+			allocated *= 2;
+		s->buffer = arena_grow( s->a, s->buffer, s->used, allocated );
+		if ( !s->buffer )
+			return 1;
+		s->allocated = allocated;
+	}
+	memcpy( s->buffer + s->used, data, len );
+	s->used += len;
+	return 0;
+}
+
+char *compress_decode( struct arena *a, const char *filename, const char *data, size_t size,
+					   size_t *out_size )
+{
+	int format = compress_detect( (const unsigned char *) data, size );
+	if ( !format_supported( format ) )
+	{
+		fprintf( stderr, "compress: %s: %s data isn't supported by this build\n", filename,
+				 format_names[format] );
+		return NULL;
+	}
+	struct source src = { (const unsigned char *) data, size, 0, NULL };
+	struct arena_sink sink = { a, NULL, 0, size * 4 + 4096 };
+	sink.buffer = arena_alloc( a, sink.allocated );
+	if ( !sink.buffer )
+		return NULL;
+	int sts = decode( format, &src, arena_sink, &sink );
+	if ( !sink.buffer )
+		return NULL;
+	if ( sts != 0 )
+	{
+		fprintf( stderr, "compress: %s: Corrupt or truncated %s data\n", filename, format_names[format] );
+		return NULL;
+	}
+	sink.buffer[sink.used] = 0;
+	*out_size = sink.used;
+	return sink.buffer;
+}
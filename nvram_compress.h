@@ -0,0 +1,61 @@
+// nvram_compress.h
+// Copyright 2015, Todd Knarr <tknarr@silverglass.org>
+// Licensed under the terms of the GPL v3 or any later version.
+// See LICENSE.md for complete license terms.
+
+// Transparent gzip and zstd compression for nvram_dump and nvram_build.
+// Compressed input is recognized by its magic bytes and decompressed on a
+// separate thread while the caller reads and parses the result from an
+// ordinary FILE. Compressed output works the same way in reverse.
+
+#ifndef NVRAM_COMPRESS_H
+#define NVRAM_COMPRESS_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "nvram_arena.h"
+
+// Most bytes compress_unread() can put back.
+#define UNREAD_MAX		512
+
+// Compression formats
+#define COMPRESS_NONE	0
+#define COMPRESS_GZIP	1
+#define COMPRESS_ZSTD	2
+
+// Returns the format named by name ("gzip", "zstd" or "none"), or -1 if
+// it's not one this build supports.
+int compress_format( const char *name );
+// Returns the format a filename's extension (".gz", ".zst") implies, or -1
+// if it's one this build doesn't support.
+int compress_format_of( const char *filename );
+// Returns the format whose magic bytes data starts with.
+int compress_detect( const unsigned char *data, size_t size );
+
+// Opens filename for reading, or the standard input if it's "-". Compressed
+// files are decompressed as they're read. Returns NULL with errno set if
+// the file can't be opened.
+FILE *compress_open( const char *filename );
+// Puts back the last len bytes read from f by returning a FILE that reads
+// them followed by the rest of f, which it takes over. That's f itself,
+// moved back, if f can seek. Returns NULL with errno set on an error.
+FILE *compress_unread( FILE *f, const char *filename, const unsigned char *data, size_t len );
+// Returns a FILE whose writes are compressed in format on a separate thread
+// and written to out, which the returned FILE takes over.
+FILE *compress_writer( FILE *out, int format );
+// Sends everything written to the standard output from now on through the
+// compressor. compress_close( stdout ) finishes it.
+int compress_stdout( int format );
+// Closes a FILE from any of the above, or any other FILE. Returns 0 on
+// success, or non-zero if there was an I/O error or the compressed data was
+// corrupt.
+int compress_close( FILE *f );
+
+// Decompresses a whole compressed file already in memory into the arena,
+// followed by a terminating NUL that isn't counted in *out_size. Returns
+// NULL if the data is corrupt or there isn't enough memory.
+char *compress_decode( struct arena *a, const char *filename, const char *data, size_t size,
+					   size_t *out_size );
+
+#endif // NVRAM_COMPRESS_H
@@ -0,0 +1,134 @@
+// nvram_crc.c
+// Copyright 2015, Todd Knarr <tknarr@silverglass.org>
+// Licensed under the terms of the GPL v3 or any later version.
+// See LICENSE.md for complete license terms.
+
+//	  This program is free software: you can redistribute it and/or modify
+//	  it under the terms of the GNU General Public License as published by
+//	  the Free Software Foundation, either version 3 of the License, or
+//	  (at your option) any later version.
+
+//	  This program is distributed in the hope that it will be useful,
+//	  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+//	  GNU General Public License for more details.
+
+//	  You should have received a copy of the GNU General Public License
+//	  along with this program.	If not, see <http://www.gnu.org/licenses/>.
+
+// The table version works eight bytes at a time ("slicing-by-8"), with the
+// tables built the first time they're needed. On x86-64 the SSE4.2 version
+// is compiled in regardless of the compiler flags and picked at run time if
+// the CPU supports it, since that's the only way most builds would get it.
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "nvram_crc.h"
+
+#if defined( __GNUC__ ) && defined( __x86_64__ )
+#define HAVE_CRC32_SSE42
+#include <nmmintrin.h>
+#endif
+
+// CRC-32C polynomial, bit-reversed
+#define CRC32C_POLY		0x82F63B78
+// hndcrc8() polynomial x^8 + x^7 + x^6 + x^4 + x^2 + 1, bit-reversed
+#define CRC8_POLY		0xAB
+
+static uint32_t crc_table[8][256];
+static uint8_t crc8_table[256];
+static unsigned int (*crc_update)( unsigned int crc, const unsigned char *p, size_t len );
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static unsigned int crc32c_table( unsigned int crc, const unsigned char *p, size_t len )
+{
+	uint32_t c = crc;
+	while ( len >= 8 )
+	{
+		uint32_t lo = c ^ ( p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24 );
+		c = crc_table[7][lo & 0xFF] ^ crc_table[6][( lo >> 8 ) & 0xFF] ^
+			crc_table[5][( lo >> 16 ) & 0xFF] ^ crc_table[4][lo >> 24] ^
+			crc_table[3][p[4]] ^ crc_table[2][p[5]] ^ crc_table[1][p[6]] ^ crc_table[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+	while ( len-- > 0 )
+		c = crc_table[0][( c ^ *p++ ) & 0xFF] ^ ( c >> 8 );
+	return c;
+}
+
+#ifdef HAVE_CRC32_SSE42
+__attribute__(( target( "sse4.2" ) ))
+static unsigned int crc32c_sse42( unsigned int crc, const unsigned char *p, size_t len )
+{
+	unsigned long long c = crc;
+	while ( len >= 8 )
+	{
+		unsigned long long v;
+		memcpy( &v, p, 8 );
+		c = _mm_crc32_u64( c, v );
+		p += 8;
+		len -= 8;
+	}
+	uint32_t c32 = c;
+	while ( len-- > 0 )
+		c32 = _mm_crc32_u8( c32, *p++ );
+	return c32;
+}
+#endif
+
+static void crc_init( void )
+{
+	uint32_t i, j;
+	for ( i = 0; i < 256; i++ )
+	{
+		uint32_t c = i;
+		for ( j = 0; j < 8; j++ )
+			c = ( c >> 1 ) ^ ( ( c & 1 ) ? CRC32C_POLY : 0 );
+		crc_table[0][i] = c;
+		uint8_t c8 = i;
+		for ( j = 0; j < 8; j++ )
+			c8 = ( c8 >> 1 ) ^ ( ( c8 & 1 ) ? CRC8_POLY : 0 );
+		crc8_table[i] = c8;
+	}
+	for ( i = 0; i < 256; i++ )
+		for ( j = 1; j < 8; j++ )
+			crc_table[j][i] = crc_table[0][crc_table[j-1][i] & 0xFF] ^ ( crc_table[j-1][i] >> 8 );
+
+	crc_update = crc32c_table;
+#ifdef HAVE_CRC32_SSE42
+	if ( __builtin_cpu_supports( "sse4.2" ) )
+		crc_update = crc32c_sse42;
+#endif
+}
+
+unsigned int crc32c( unsigned int crc, const void *data, size_t len )
+{
+	pthread_once( &crc_once, crc_init );
+	return ~crc_update( ~crc, data, len );
+}
+
+unsigned int crc8( unsigned int crc, const void *data, size_t len )
+{
+	const unsigned char *p = data;
+	pthread_once( &crc_once, crc_init );
+	while ( len-- > 0 )
+		crc = crc8_table[( crc ^ *p++ ) & 0xFF];
+	return crc;
+}
+
+unsigned long long record_hash( const char *name, size_t name_len, const char *value, size_t value_len )
+{
+	// The 64-bit finalizer from MurmurHash3, which spreads every bit of the
+	// two CRCs over the whole result.
+	unsigned long long h = (unsigned long long) crc32c( 0, name, name_len ) << 32 |
+		crc32c( 0, value, value_len );
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return h;
+}
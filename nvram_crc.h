@@ -0,0 +1,30 @@
+// nvram_crc.h
+// Copyright 2015, Todd Knarr <tknarr@silverglass.org>
+// Licensed under the terms of the GPL v3 or any later version.
+// See LICENSE.md for complete license terms.
+
+// CRC-32C (Castagnoli), using the SSE4.2 crc32 instruction when the CPU
+// has it and tables otherwise, and the record hashes nvram_dump builds its
+// --fingerprint out of. Also the CRC-8 that guards the NVRAM partition in
+// flash.
+
+#ifndef NVRAM_CRC_H
+#define NVRAM_CRC_H
+
+#include <stddef.h>
+
+// Returns the CRC-32C of len bytes at data continuing from crc, which is 0
+// to start with, the same way zlib's crc32() is used.
+unsigned int crc32c( unsigned int crc, const void *data, size_t len );
+
+// Returns the CRC-8 of len bytes at data continuing from crc, the Broadcom
+// hndcrc8() used for the NVRAM partition's header. Unlike crc32c() the
+// starting value, normally 0xFF, is passed as crc and nothing is inverted.
+unsigned int crc8( unsigned int crc, const void *data, size_t len );
+
+// Returns a 64-bit hash of one name and value. The CRCs of the two are
+// mixed together so that, unlike the CRCs themselves, the hashes of
+// different records can be added up without cancelling out.
+unsigned long long record_hash( const char *name, size_t name_len, const char *value, size_t value_len );
+
+#endif // NVRAM_CRC_H
@@ -26,7 +26,15 @@
 // always fully escaped since we expect them to never contain newlines.
 // If the '-d' option is given the file format is set to be the one
 // used by /etc/defaults.ini containing the initial default values,
-// otherwise the standard NVRAM backup format is read.
+// otherwise the standard NVRAM backup format is read. Raw images of the
+// NVRAM partition in flash are recognized and read as well. With '--json' the
+// entries are written as JSON lines instead, one object per entry or per
+// file. With '-u' well-formed UTF-8 in values is passed through unescaped,
+// and '--sort' writes the entries in order by name. '--fingerprint' writes
+// an order-independent hash of each file's entries instead of the entries,
+// '--check' only checks that each file's structure is sound, and '--lint'
+// checks the entries against a file of rules. '--redact' replaces the values
+// of passwords, keys and the like so the output can be handed on.
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,220 +42,2790 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <regex.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-// Output string escaping mode
+#include "nvram_arena.h"
+#include "nvram_compress.h"
+#include "nvram_crc.h"
+#include "nvram_io.h"
+#include "nvram_match.h"
+#include "nvram_queue.h"
+#include "nvram_stats.h"
+#include "nvram_tar.h"
+#include "nvram_trace.h"
+
+// Output string escaping mode, ESC_FULL or ESC_HUMAN plus ESC_UTF8 to pass
+// UTF-8 through unescaped, and ESC_BYTES for JSON to write every byte that
+// isn't ASCII as \u0080 to \u00FF
 #define ESC_FULL   0
 #define ESC_HUMAN  1
+#define ESC_UTF8   2
+#define ESC_BYTES  4
+
+// File format
+#define FMT_NVRAM		0
+#define FMT_DEFAULTS	1
+#define FMT_FLASH		2	// Found by its magic number, never asked for
+
+// Output format: name=value text, JSON lines with one object per record
+// or one per file, or raw name=value entries each ended by a NUL.
+#define OUT_TEXT		0
+#define OUT_JSON		1
+#define OUT_JSON_FILE	2
+#define OUT_RAW			3
+#define OUT_FINGERPRINT	4
+#define OUT_FINGERPRINT_KEYS	5
+
+// Record order for --sort: as in the file, by name, or by name with only
+// the last record of each name kept
+#define SORT_NONE		0
+#define SORT_NAME		1
+#define SORT_UNIQUE		2
+
+// Long-only options
+#define OPT_STATS		256
+#define OPT_TRACE		257
+#define OPT_STREAM		258
+#define OPT_URING		259
+#define OPT_PIPELINE	260
+#define OPT_COMPRESS	261
+#define OPT_JSON		262
+#define OPT_JSON_BYTES	263
+#define OPT_SORT		264
+#define OPT_FINGERPRINT	265
+#define OPT_CHECK		266
+#define OPT_LINT		267
+#define OPT_REDACT		268
+
+// What --redact writes in place of a value.
+#define REDACTED		"<redacted>"
+#define REDACTED_LEN	10
+
+// Number of files the batch reader keeps in flight unless told otherwise.
+#define DEFAULT_URING_DEPTH	32
+
+// The low-footprint build streams by default and starts with a small arena.
+#ifdef NVRAM_SMALL
+#define DEFAULT_STREAM		1
+#define ARENA_BLOCK_SIZE	( 4*1024 )
+#else
+#define DEFAULT_STREAM		0
+#define ARENA_BLOCK_SIZE	( 256*1024 )
+#endif
+
+// Size of the pieces values are read and escaped in when streaming.
+#define STREAM_CHUNK	4096
+
+// Parallel escaping with -j: files smaller than this are escaped on one
+// thread, and larger ones are split into this many chunks per thread.
+#define PARALLEL_MIN_SIZE	( 256*1024 )
+#define CHUNKS_PER_THREAD	4
+#define MAX_THREADS			256
+
+// Files at least this big have their record boundaries found in parallel
+// with -j as well.
+#define SPECULATE_MIN_SIZE	( 1024*1024 )
+
+// Buffers in each direction between the --pipeline threads, and their size.
+#define PIPE_BUFFERS		4
+#define PIPE_BUFFER_SIZE	( 256*1024 )
+
+// Room for everything in a --json record's line besides the filename, name
+// and value: the punctuation, the keys and the record index.
+#define JSON_RECORD_ROOM	64
+
+// Groups of records smaller than this are sorted by insertion rather than
+// with another radix pass.
+#define SORT_INSERTION_MAX	32
+
+
+// Escapes of the control characters that have one of their own.
+static const char control_escape[32] =
+{
+	[ '\a' ] = 'a', [ '\b' ] = 'b', [ '\f' ] = 'f', [ '\n' ] = 'n',
+	[ '\r' ] = 'r', [ '\t' ] = 't', [ '\v' ] = 'v'
+};
+
+static const char hex_digit[] = "0123456789ABCDEF";
+
+// Returns the length of the well-formed UTF-8 sequence at the start of the
+// len bytes at s, or 0 if there isn't one. Overlong forms, surrogates, code
+// points past U+10FFFF and the C1 control characters don't count.
+static size_t utf8_length( const unsigned char *s, size_t len )
+{
+	unsigned char lo = 0x80, hi = 0xBF;
+	size_t n, k;
+	if ( s[0] >= 0xC2 && s[0] <= 0xDF )
+	{
+		n = 2;
+		if ( s[0] == 0xC2 )
+			lo = 0xA0; // U+0080 to U+009F are control characters
+	}
+	else if ( s[0] >= 0xE0 && s[0] <= 0xEF )
+	{
+		n = 3;
+		if ( s[0] == 0xE0 )
+			lo = 0xA0;
+		else if ( s[0] == 0xED )
+			hi = 0x9F;
+	}
+	else if ( s[0] >= 0xF0 && s[0] <= 0xF4 )
+	{
+		n = 4;
+		if ( s[0] == 0xF0 )
+			lo = 0x90;
+		else if ( s[0] == 0xF4 )
+			hi = 0x8F;
+	}
+	else
+		return 0;
+	if ( n > len || s[1] < lo || s[1] > hi )
+		return 0;
+	for ( k = 2; k < n; k++ )
+	{
+		if ( ( s[k] & 0xC0 ) != 0x80 )
+			return 0;
+	}
+	return n;
+}
+
+// Returns how many of the last bytes of the len bytes at s start a UTF-8
+// sequence that carries on past them, so a value being escaped a piece at a
+// time can hold them over to the next piece.
+static size_t utf8_partial( const unsigned char *s, size_t len )
+{
+	size_t k;
+	for ( k = 1; k <= 3 && k <= len; k++ )
+	{
+		unsigned char c = s[len - k];
+		if ( ( c & 0xC0 ) != 0x80 )
+		{
+			size_t n = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+			return n > k ? k : 0;
+		}
+	}
+	return 0;
+}
+
+// Returns the number of characters copied to dest. Only the first len
+// characters of src are looked at, and copying stops early at a NUL.
+// Printable ASCII is copied as-is, 16 characters at a time where there's
+// SSE2. With ESC_UTF8 in escape_mode so are well-formed UTF-8 sequences,
+// leaving only control characters and bytes that aren't part of one to be
+// escaped.
+size_t escape_string( int escape_mode, const char *src, size_t len, char *dest, size_t max )
+{
+	if ( !src || !dest || max == 0 )
+		return 0;
+
+	const unsigned char *s = (const unsigned char *) src;
+	size_t i = 0, j = 0, n;
+	while ( i < len )
+	{
+#ifdef __SSE2__
+		while ( i + 16 <= len && j + 16 < max )
+		{
+			// Bytes below a space and from 0x80 up are both less than a space
+			// when compared as signed bytes.
+			__m128i v = _mm_loadu_si128( (const __m128i *) ( s + i ) );
+			__m128i special = _mm_or_si128( _mm_cmplt_epi8( v, _mm_set1_epi8( ' ' ) ),
+											_mm_or_si128( _mm_cmpeq_epi8( v, _mm_set1_epi8( 0x7F ) ),
+														  _mm_cmpeq_epi8( v, _mm_set1_epi8( '\\' ) ) ) );
+			int mask = _mm_movemask_epi8( special );
+			int run = mask ? __builtin_ctz( mask ) : 16;
+			_mm_storeu_si128( (__m128i *) ( dest + j ), v );
+			i += run;
+			j += run;
+			if ( mask )
+				break;
+		}
+		if ( i >= len )
+			break;
+#endif
+		unsigned char c = s[i];
+		char esc[4];
+		if ( c == 0 )
+			break;
+		if ( c >= ' ' && c < 0x7F && c != '\\' )
+		{
+			esc[0] = c;
+			n = 1;
+		}
+		else if ( ( escape_mode & ESC_UTF8 ) && c >= 0x80 && ( n = utf8_length( s + i, len - i ) ) > 0 )
+		{
+			if ( j + n >= max )
+				break;
+			memcpy( dest + j, s + i, n );
+			i += n;
+			j += n;
+			continue;
+		}
+		else if ( c == '\\' || ( c == '\n' && ( escape_mode & ESC_HUMAN ) ) )
+		{
+			esc[0] = '\\';
+			esc[1] = c;
+			n = 2;
+		}
+		else if ( c < 32 && control_escape[c] )
+		{
+			esc[0] = '\\';
+			esc[1] = control_escape[c];
+			n = 2;
+		}
+		else
+		{
+			esc[0] = '\\';
+			esc[1] = 'x';
+			esc[2] = hex_digit[c >> 4];
+			esc[3] = hex_digit[c & 0xF];
+			n = 4;
+		}
+		if ( j + n >= max )
+			break;
+		memcpy( dest + j, esc, n );
+		i++;
+		j += n;
+	}
+	dest[j] = 0;
+
+	return i;
+}
+
+// Writes the first len characters of src into dest as the contents of a
+// JSON string, without the quotes, and returns the number of characters
+// copied. Like escape_string(), copying stops early at a NUL or when dest
+// is full. Well-formed UTF-8 sequences are copied as-is, so any JSON parser
+// reads them as the text they are. Other bytes that aren't ASCII are written
+// as the code point with the same value, \u0080 to \u00FF, as are all of
+// them with ESC_BYTES in escape_mode, which nvram_build --json-bytes reads
+// back byte for byte. dest needs room for six times len to be sure of
+// holding all of it.
+size_t json_string( int escape_mode, const char *src, size_t len, char *dest, size_t max )
+{
+	if ( !src || !dest || max == 0 )
+		return 0;
+
+	size_t i, j = 0, n;
+	for ( i = 0; i < len && src[i]; i++ )
+	{
+		unsigned char c = src[i];
+		char esc = 0;
+		if ( !( escape_mode & ESC_BYTES ) && c >= 0x80 &&
+			 ( n = utf8_length( (const unsigned char *) src + i, len - i ) ) > 0 )
+		{
+			if ( j + n >= max )
+				break;
+			memcpy( dest + j, src + i, n );
+			i += n - 1;
+			j += n;
+			continue;
+		}
+		if ( c >= 0x20 && c < 0x80 && c != '"' && c != '\\' )
+		{
+			if ( j + 1 >= max )
+				break;
+			dest[j++] = c;
+			continue;
+		}
+		switch ( c )
+		{
+		case '"':  esc = '"';  break;
+		case '\\': esc = '\\'; break;
+		case '\n': esc = 'n';  break;
+		case '\r': esc = 'r';  break;
+		case '\t': esc = 't';  break;
+		case '\b': esc = 'b';  break;
+		case '\f': esc = 'f';  break;
+		}
+		if ( esc )
+		{
+			if ( j + 2 >= max )
+				break;
+			dest[j++] = '\\';
+			dest[j++] = esc;
+		}
+		else
+		{
+			if ( j + 6 >= max )
+				break;
+			memcpy( dest + j, "\\u00", 4 );
+			dest[j+4] = hex_digit[c >> 4];
+			dest[j+5] = hex_digit[c & 0xF];
+			j += 6;
+		}
+	}
+	dest[j] = 0;
+
+	return i;
+}
+
+// Warns about a name with characters that escape_string() has to escape.
+// Only called for names whose JSON encoding showed they might have some.
+static void warn_name( const char *filename, unsigned int record, const char *name, size_t name_len )
+{
+	char esc_name[255*4 + 1];
+	escape_string( ESC_FULL, name, name_len, esc_name, sizeof esc_name );
+	if ( strlen( esc_name ) > name_len )
+		fprintf( stderr, "dump_file: File %s: Record %u: Name %s: contains non-printable characters\n",
+				 filename, record, esc_name );
+}
+
+// One parameter record, pointing into the buffer holding the backup file.
+struct nvram_record
+{
+	const char *name;
+	const char *value;
+	unsigned int name_len;
+	unsigned int value_len;
+};
+
+// All of the state for dumping files. Nothing in here is shared with other
+// contexts, so separate contexts can be used from separate threads.
+struct dump_context
+{
+	int escape_mode;
+	int file_format;
+	int output;					// OUT_TEXT or one of the JSON formats
+	int sort;					// SORT_NONE or the order to write records in
+	int stream;					// Use dump_stream() instead of reading whole files
+	int pipeline;				// Use dump_pipeline() instead of reading whole files
+	int threads;				// Threads for escaping a file in parallel
+	const struct matcher *redact;	// Names whose values --redact hides, or NULL
+	struct arena arena;			// Working memory, reset for each file
+	struct nvram_stats total;	// Running totals for --stats across all files
+};
+
+void dump_init( struct dump_context *ctx, int escape_mode, int file_format )
+{
+	ctx->escape_mode = escape_mode;
+	ctx->file_format = file_format;
+	ctx->output = OUT_TEXT;
+	ctx->sort = SORT_NONE;
+	ctx->stream = DEFAULT_STREAM;
+	ctx->pipeline = 0;
+	ctx->threads = 1;
+	ctx->redact = NULL;
+	arena_init( &ctx->arena, ARENA_BLOCK_SIZE );
+	stats_clear( &ctx->total );
+}
+
+void dump_cleanup( struct dump_context *ctx )
+{
+	arena_free( &ctx->arena );
+}
+
+// Returns the value to write for the record called name: value itself, or
+// REDACTED in its place if --redact matches the name, with *value_len
+// changed to suit. Either way it's looked at before anything is escaped, so
+// a hidden value's bytes never are. Names that don't match cost a single
+// pass of the automaton over the name.
+static inline const char *redact_value( const struct dump_context *ctx, const char *name, size_t name_len,
+										const char *value, size_t *value_len )
+{
+	if ( !ctx->redact || !matcher_any( ctx->redact, name, name_len ) )
+		return value;
+	*value_len = REDACTED_LEN;
+	return REDACTED;
+}
+
+// Parts of names whose values --redact hides when it isn't given a file of
+// its own: passwords, pre-shared and WEP keys, RADIUS and other shared
+// secrets, SNMP communities, OpenVPN keys and WPS PINs.
+static const char *const redact_defaults[] =
+{
+	"pass", "psk", "key", "secret", "community", "tlsauth", "token", "_pin",
+	NULL
+};
+
+// Builds the matcher for --redact from filename, one pattern per line in
+// the same form as the patterns in a --lint rules file, or from
+// redact_defaults if filename is NULL. Case is ignored. Returns NULL if the
+// file can't be read or there isn't enough memory.
+struct matcher *redact_load( const char *filename )
+{
+	struct matcher *m = matcher_new( 1 );
+	if ( !m )
+	{
+		fprintf( stderr, "redact_load: Out of memory\n" );
+		return NULL;
+	}
+	int ret = 0, id = 0;
+	if ( !filename )
+	{
+		for ( id = 0; ret == 0 && redact_defaults[id]; id++ )
+			ret = matcher_add( m, redact_defaults[id], strlen( redact_defaults[id] ), id );
+	}
+	else
+	{
+		FILE *f = fopen( filename, "r" );
+		if ( !f )
+		{
+			fprintf( stderr, "redact_load: Error opening %s: %s\n", filename, strerror( errno ) );
+			matcher_free( m );
+			return NULL;
+		}
+		char *line = NULL;
+		size_t allocated = 0;
+		ssize_t len;
+		while ( ret == 0 && ( len = getline( &line, &allocated, f ) ) >= 0 )
+		{
+			while ( len > 0 && isspace( (unsigned char) line[len-1] ) )
+				line[--len] = 0;
+			char *pattern = line + strspn( line, " \t" );
+			if ( *pattern == 0 || *pattern == '#' )
+				continue;
+			ret = matcher_add( m, pattern, strlen( pattern ), id++ );
+		}
+		free( line );
+		fclose( f );
+	}
+	if ( ret != 0 || matcher_compile( m ) != 0 )
+	{
+		fprintf( stderr, "redact_load: Out of memory\n" );
+		matcher_free( m );
+		return NULL;
+	}
+	return m;
+}
+
+// Reads a length of len_size bytes, low byte first.
+static unsigned int read_length( const unsigned char *p, size_t len_size )
+{
+	return ( len_size == 1 ) ? p[0] : p[1] * 256 + p[0]; // TODO byte ordering
+}
+
+// Reads the record count out of the header at the start of a backup.
+static unsigned int read_record_count( int file_format, const unsigned char *header )
+{
+	return read_length( header + ( ( file_format == FMT_DEFAULTS ) ? 0 : 6 ), 2 );
+}
+
+// The part of a record that parse_record() found running past the end of
+// the buffer, and what each is called in error messages.
+#define BROKEN_NAME_LENGTH	1
+#define BROKEN_NAME			2
+#define BROKEN_VALUE_LENGTH	3
+#define BROKEN_VALUE		4
+
+static const char *const broken_parts[] = { "", "name length", "name", "value length", "value" };
+
+static size_t record_broken( int *broken, int part )
+{
+	if ( broken )
+		*broken = part;
+	return 0;
+}
+
+// Parses the record at pos into *r without reporting anything. Returns the
+// offset just past the record, or 0 if it runs past the end of the buffer.
+// Then if broken isn't NULL it's set to the part that didn't fit, and the
+// fields of *r before that part are filled in.
+static size_t parse_record( int file_format, const unsigned char *buffer, size_t size, size_t pos,
+							struct nvram_record *r, int *broken )
+{
+	size_t len_size = ( file_format == FMT_DEFAULTS ) ? 1 : 2;
+	if ( pos + 1 > size )
+		return record_broken( broken, BROKEN_NAME_LENGTH );
+	r->name_len = buffer[pos++];
+	r->name = (const char *) buffer + pos;
+	if ( pos + r->name_len > size )
+		return record_broken( broken, BROKEN_NAME );
+	pos += r->name_len;
+	if ( pos + len_size > size )
+		return record_broken( broken, BROKEN_VALUE_LENGTH );
+	r->value_len = read_length( buffer + pos, len_size );
+	pos += len_size;
+	r->value = (const char *) buffer + pos;
+	if ( pos + r->value_len > size )
+		return record_broken( broken, BROKEN_VALUE );
+	return pos + r->value_len;
+}
+
+// Walks the records in buffer starting with record number record at *pos,
+// filling in records[] up to record_count. Returns the number of complete
+// records found, with *pos just past the last one. If the chain of records
+// is broken an error is reported and *err set, and the records before the
+// break are returned.
+static unsigned int walk_records( int file_format, const char *filename,
+								  const unsigned char *buffer, size_t size, size_t *start,
+								  unsigned int record, unsigned int record_count,
+								  struct nvram_record *records, int *err )
+{
+	*err = 0;
+	while ( record < record_count )
+	{
+		int broken;
+		size_t next = parse_record( file_format, buffer, size, *start, &records[record], &broken );
+		if ( !next )
+		{
+			fprintf( stderr, "dump_file: File %s: Error reading %s from record %u\n",
+					 filename, broken_parts[broken], record+1 );
+			*err = 1;
+			break;
+		}
+		*start = next;
+		record++;
+	}
+	return record;
+}
+
+// A raw image of the NVRAM partition in flash starts with a 20-byte header:
+// the "FLSH" magic and four 32-bit little-endian words, the length of the
+// header and strings together, the CRC-8 in the low byte of the next word,
+// and two words of memory controller settings. The settings are NUL-ended
+// name=value strings after that, the last one followed by an empty one.
+// The CRC covers the header from the byte after it on, then the strings.
+#define FLASH_HEADER_SIZE	20
+#define FLASH_CRC_START		9
+
+// Returns non-zero if buffer holds an image of the partition in flash
+// rather than a backup.
+static int is_flash( const unsigned char *buffer, size_t size )
+{
+	return size >= 4 && memcmp( buffer, "FLSH", 4 ) == 0;
+}
+
+// Checks the header of a flash image. Returns 0 if it's sound, or else
+// writes what's wrong with it and where into problem and returns 1 if the
+// strings can still be read or -1 if they can't. *end is set to the offset
+// just past the strings' part of the image.
+static int flash_header( const unsigned char *buffer, size_t size, size_t *end, char *problem, size_t max )
+{
+	if ( size < FLASH_HEADER_SIZE )
+	{
+		snprintf( problem, max, "Missing or short flash header at offset 0" );
+		return -1;
+	}
+	unsigned long len = buffer[4] | buffer[5] << 8 | buffer[6] << 16 | (unsigned long) buffer[7] << 24;
+	if ( len < FLASH_HEADER_SIZE || len > size )
+	{
+		snprintf( problem, max, "Length %lu in flash header is outside the file at offset 4", len );
+		return -1;
+	}
+	*end = len;
+
+	unsigned int crc = crc8( 0xFF, buffer + FLASH_CRC_START, FLASH_HEADER_SIZE - FLASH_CRC_START );
+	crc = crc8( crc, buffer + FLASH_HEADER_SIZE, len - FLASH_HEADER_SIZE );
+	if ( crc != buffer[8] )
+	{
+		snprintf( problem, max, "Flash CRC is %02X but the header says %02X at offset 8", crc, buffer[8] );
+		return 1;
+	}
+	return 0;
+}
+
+// Splits the strings of a flash image, from the header up to end, into
+// records pointing into the buffer, stopping at the empty string after the
+// last one. A string with no '=' is all name. records may be NULL to just
+// count them. Returns the number of records, with *pos just past the last
+// string, which is end if the strings aren't ended properly.
+static unsigned int walk_flash( const unsigned char *buffer, size_t end, size_t *pos,
+								struct nvram_record *records )
+{
+	const char *p = (const char *) buffer + FLASH_HEADER_SIZE, *limit = (const char *) buffer + end;
+	unsigned int count = 0;
+	while ( p < limit && *p )
+	{
+		const char *nul = memchr( p, 0, limit - p );
+		if ( !nul )
+			nul = limit;
+		if ( records )
+		{
+			const char *eq = memchr( p, '=', nul - p );
+			records[count].name = p;
+			records[count].name_len = ( eq ? eq : nul ) - p;
+			records[count].value = eq ? eq + 1 : nul;
+			records[count].value_len = eq ? nul - ( eq + 1 ) : 0;
+		}
+		count++;
+		p = nul + 1;
+	}
+	*pos = p < limit ? (size_t) ( p - (const char *) buffer ) : end;
+	return count;
+}
+
+// A record's name and its number in the file, which is all sorting needs.
+// Sorting these rather than the records keeps the keys small and together.
+struct sort_key
+{
+	const unsigned char *name;
+	unsigned int name_len;
+	unsigned int record;
+};
+
+// The byte of k's name at depth as a radix digit, 1 to 256, or 0 past the
+// end of the name so that shorter names come first.
+static inline unsigned int sort_digit( const struct sort_key *k, unsigned int depth )
+{
+	return depth < k->name_len ? k->name[depth] + 1 : 0;
+}
+
+// Compares the names of a and b, which are the same up to depth.
+static int sort_compare( const struct sort_key *a, const struct sort_key *b, unsigned int depth )
+{
+	unsigned int len = a->name_len < b->name_len ? a->name_len : b->name_len;
+	int cmp = len > depth ? memcmp( a->name + depth, b->name + depth, len - depth ) : 0;
+	return cmp ? cmp : (int) a->name_len - (int) b->name_len;
+}
+
+// Sorts count keys whose names all start with the same depth bytes by name,
+// keeping keys with the same name in file order. It's a most significant
+// byte first radix sort: each pass deals the keys into buckets by their
+// next byte through tmp, which has room for count keys, and then sorts each
+// bucket on the byte after that. Small buckets get an insertion sort.
+static void sort_keys( struct sort_key *keys, struct sort_key *tmp, unsigned int count, unsigned int depth )
+{
+	unsigned int start[257], end[257];
+	unsigned int i, j, d;
+
+	while ( count >= SORT_INSERTION_MAX )
+	{
+		memset( end, 0, sizeof end );
+		for ( i = 0; i < count; i++ )
+			end[sort_digit( &keys[i], depth )]++;
+		if ( end[0] == count )
+			return; // All the same name
+		if ( end[0] == 0 )
+		{
+			// A byte every name shares, like the "wl0_" of a group of
+			// wireless settings, needs no pass at all.
+			for ( d = 1; d < 257 && end[d] == 0; d++ )
+				;
+			if ( end[d] == count )
+			{
+				depth++;
+				continue;
+			}
+		}
+		for ( d = 0, j = 0; d < 257; d++ )
+		{
+			start[d] = j;
+			j += end[d];
+			end[d] = start[d];
+		}
+		for ( i = 0; i < count; i++ )
+			tmp[end[sort_digit( &keys[i], depth )]++] = keys[i];
+		memcpy( keys, tmp, count * sizeof (struct sort_key) );
+
+		// Names that end here are all the same, so bucket 0 is done.
+		for ( d = 1; d < 257; d++ )
+			if ( end[d] - start[d] > 1 )
+				sort_keys( keys + start[d], tmp, end[d] - start[d], depth + 1 );
+		return;
+	}
+
+	for ( i = 1; i < count; i++ )
+	{
+		struct sort_key k = keys[i];
+		for ( j = i; j > 0 && sort_compare( &keys[j-1], &k, depth ) > 0; j-- )
+			keys[j] = keys[j-1];
+		keys[j] = k;
+	}
+}
+
+// Puts the count records in order by name for --sort. Empty records, which
+// are never written, are dropped, as is every record but the last of each
+// name with SORT_UNIQUE, the way loading the backup would leave them.
+// *index is set to each remaining record's number in the file. Returns the
+// number of records left, or -1 if there isn't enough memory.
+static int sort_records( struct arena *a, int sort, struct nvram_record *records, unsigned int count,
+						 unsigned int **index )
+{
+	struct sort_key *keys = arena_alloc( a, ( count + 1 ) * sizeof (struct sort_key) );
+	struct sort_key *tmp = arena_alloc( a, ( count + 1 ) * sizeof (struct sort_key) );
+	struct nvram_record *sorted = arena_alloc( a, ( count + 1 ) * sizeof (struct nvram_record) );
+	*index = arena_alloc( a, ( count + 1 ) * sizeof (unsigned int) );
+	if ( !keys || !tmp || !sorted || !*index )
+		return -1;
+
+	unsigned int record, n = 0;
+	for ( record = 0; record < count; record++ )
+	{
+		const struct nvram_record *r = &records[record];
+		unsigned int name_len = strnlen( r->name, r->name_len );
+		if ( name_len == 0 && strnlen( r->value, r->value_len ) == 0 )
+			continue;
+		keys[n].name = (const unsigned char *) r->name;
+		keys[n].name_len = name_len;
+		keys[n].record = record;
+		n++;
+	}
+	sort_keys( keys, tmp, n, 0 );
+
+	unsigned int i, kept = 0;
+	for ( i = 0; i < n; i++ )
+	{
+		if ( sort == SORT_UNIQUE && i + 1 < n && sort_compare( &keys[i], &keys[i+1], 0 ) == 0 )
+			continue;
+		sorted[kept] = records[keys[i].record];
+		(*index)[kept] = keys[i].record;
+		kept++;
+	}
+	memcpy( records, sorted, kept * sizeof (struct nvram_record) );
+	return kept;
+}
+
+// Runs fn( arg ) on the calling thread and threads-1 more, and waits for
+// all of them to finish. If threads can't be started the calling thread
+// does all of the work.
+static void run_threads( int threads, void *(*fn)( void * ), void *arg )
+{
+	pthread_t tids[MAX_THREADS];
+	int i, started = 0;
+	if ( threads > MAX_THREADS )
+		threads = MAX_THREADS;
+	for ( i = 1; i < threads; i++ )
+	{
+		if ( pthread_create( &tids[started], NULL, fn, arg ) != 0 )
+			break;
+		started++;
+	}
+	fn( arg );
+	for ( i = 0; i < started; i++ )
+		pthread_join( tids[i], NULL );
+}
+
+// Speculative record discovery for -j on large files. Record boundaries can
+// only be known for certain by following the length prefixes from the
+// header, so each thread instead takes a segment of the file, guesses where
+// the first record in it starts by looking for a run of plausible records,
+// and walks from there. The main thread then follows the real chain: where
+// it lands on a record a thread found, the chains are the same from there on
+// and the thread's records are used; where it doesn't (a wrong guess) that
+// segment is walked again. The result is always what walk_records() finds.
+
+// Number of plausible records in a row needed to accept a guessed start.
+#define SPEC_CHAIN	8
+
+struct spec_segment
+{
+	size_t start;		// Records starting in [start, end) belong here
+	size_t end;
+	int exact;			// start is known to be a record boundary
+	struct nvram_record *records;
+	unsigned int count;
+	unsigned int allocated;
+};
+
+struct spec_job
+{
+	int file_format;
+	const char *filename;
+	const unsigned char *buffer;
+	size_t size;
+	struct spec_segment *segments;
+	unsigned int segment_count;
+	unsigned int next_segment;
+};
+
+// Offset of the record's name length byte in the buffer.
+static size_t record_offset( const unsigned char *buffer, const struct nvram_record *r )
+{
+	return (const unsigned char *) r->name - buffer - 1;
+}
+
+// Checks whether a chain of SPEC_CHAIN records with printable names (or
+// records reaching exactly to the end of the buffer) starts at pos.
+static int plausible_chain( int file_format, const unsigned char *buffer, size_t size, size_t pos )
+{
+	struct nvram_record r;
+	int n;
+	unsigned int i;
+	for ( n = 0; n < SPEC_CHAIN && pos < size; n++ )
+	{
+		pos = parse_record( file_format, buffer, size, pos, &r, NULL );
+		if ( !pos || r.name_len == 0 )
+			return 0;
+		for ( i = 0; i < r.name_len; i++ )
+			if ( !isgraph( (unsigned char) r.name[i] ) )
+				return 0;
+	}
+	return 1;
+}
+
+static void *spec_worker( void *arg )
+{
+	struct spec_job *job = arg;
+	unsigned int k;
+	while ( ( k = __atomic_fetch_add( &job->next_segment, 1, __ATOMIC_RELAXED ) ) < job->segment_count )
+	{
+		struct spec_segment *seg = &job->segments[k];
+		double t = stats_now();
+		size_t pos = seg->start, next;
+
+		if ( !seg->exact )
+			while ( pos < seg->end && !plausible_chain( job->file_format, job->buffer, job->size, pos ) )
+				pos++;
+		while ( pos < seg->end )
+		{
+			if ( seg->count == seg->allocated )
+			{
+				unsigned int allocated = seg->allocated ? seg->allocated * 2 : 1024;
+				struct nvram_record *p = realloc( seg->records, allocated * sizeof (struct nvram_record) );
+				if ( !p )
+					break; // The main thread walks whatever's missing
+				seg->records = p;
+				seg->allocated = allocated;
+			}
+			next = parse_record( job->file_format, job->buffer, job->size, pos, &seg->records[seg->count], NULL );
+			if ( !next )
+				break;
+			seg->count++;
+			pos = next;
+		}
+		trace_span( "discover", "segment", t, stats_now(), job->filename );
+	}
+	return NULL;
+}
+
+// Finds where the record at pos is in seg's list, or returns seg->count.
+static unsigned int spec_find( const unsigned char *buffer, const struct spec_segment *seg, size_t pos )
+{
+	unsigned int lo = 0, hi = seg->count;
+	while ( lo < hi )
+	{
+		unsigned int mid = lo + ( hi - lo ) / 2;
+		size_t offset = record_offset( buffer, &seg->records[mid] );
+		if ( offset == pos )
+			return mid;
+		if ( offset < pos )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return seg->count;
+}
+
+// Same as walk_records() from the header, with the work split across
+// threads as described above.
+static unsigned int walk_records_parallel( int file_format, const char *filename, int threads,
+										   const unsigned char *buffer, size_t size,
+										   unsigned int record_count, struct nvram_record *records,
+										   int *err )
+{
+	size_t pos = ( file_format == FMT_DEFAULTS ) ? 4 : 8;
+	unsigned int segment_count = threads * CHUNKS_PER_THREAD, k;
+	struct spec_segment *segments = calloc( segment_count, sizeof (struct spec_segment) );
+	if ( !segments )
+		return walk_records( file_format, filename, buffer, size, &pos, 0, record_count, records, err );
+
+	size_t segment_size = ( size - pos ) / segment_count + 1;
+	for ( k = 0; k < segment_count; k++ )
+	{
+		segments[k].start = pos + k * segment_size;
+		segments[k].end = segments[k].start + segment_size;
+		if ( segments[k].start > size )
+			segments[k].start = size;
+		if ( segments[k].end > size )
+			segments[k].end = size;
+	}
+	segments[0].exact = 1;
+
+	struct spec_job job = { file_format, filename, buffer, size, segments, segment_count, 0 };
+	run_threads( threads, spec_worker, &job );
+
+	// Follow the real chain through the segments.
+	unsigned int record = 0;
+	for ( k = 0; k < segment_count && record < record_count; k++ )
+	{
+		struct spec_segment *seg = &segments[k];
+		if ( pos >= seg->end )
+			continue; // A big record took the chain right past this segment
+		unsigned int i = spec_find( buffer, seg, pos );
+		if ( i < seg->count )
+		{
+			// The thread's chain joins the real one here.
+			unsigned int n = seg->count - i;
+			if ( n > record_count - record )
+				n = record_count - record;
+			memcpy( records + record, seg->records + i, n * sizeof (struct nvram_record) );
+			record += n;
+			const struct nvram_record *last = &records[record-1];
+			pos = (const unsigned char *) last->value - buffer + last->value_len;
+			if ( i + n == seg->count )
+				continue;
+		}
+		else
+		{
+			// Wrong guess, walk this segment for real.
+			size_t next;
+			while ( pos < seg->end && record < record_count &&
+					( next = parse_record( file_format, buffer, size, pos, &records[record], NULL ) ) )
+			{
+				record++;
+				pos = next;
+			}
+			if ( pos >= seg->end || record == record_count )
+				continue;
+		}
+		break; // Out of records, or a broken chain for walk_records() to report
+	}
+	for ( k = 0; k < segment_count; k++ )
+		free( segments[k].records );
+	free( segments );
+
+	*err = 0;
+	if ( record < record_count )
+		record = walk_records( file_format, filename, buffer, size, &pos, record, record_count, records, err );
+	return record;
+}
+
+// One buffer passed between the pipeline's threads. A buffer with size 0
+// marks the end of the data.
+struct pipe_buffer
+{
+	char *data;
+	size_t size;
+};
+
+// The threads of a --pipeline dump. The reader thread fills input buffers
+// from the file, the calling thread parses and escapes them into output
+// buffers, and the writer thread writes those to stdout. Empty buffers go
+// back the other way on the free queues.
+struct pipeline
+{
+	FILE *f;
+	const char *filename;
+	struct spsc_queue in_full, in_free;
+	struct spsc_queue out_full, out_free;
+	struct pipe_buffer buffers[PIPE_BUFFERS*2];
+	struct pipe_buffer *in;		// Input buffer being parsed
+	size_t in_pos;
+	struct pipe_buffer *out;	// Output buffer being filled
+	int stop;					// Set when the parser wants no more input
+	int read_error;
+	int write_error;
+};
+
+// Where stream_records() reads from and writes to: either the file and
+// stdout directly, or the pipeline's reader and writer threads.
+struct dump_io
+{
+	FILE *f;
+	struct pipeline *pipe;
+};
+
+// Reads exactly size bytes. Returns 0 on success, 1 on a short read.
+static int io_read( struct dump_io *io, void *buffer, size_t size )
+{
+	if ( !io->pipe )
+		return fread( buffer, sizeof (char), size, io->f ) != size;
+
+	struct pipeline *p = io->pipe;
+	char *dest = buffer;
+	while ( size > 0 )
+	{
+		if ( p->in->size == 0 )
+			return 1; // End of the data
+		if ( p->in_pos == p->in->size )
+		{
+			queue_push_wait( &p->in_free, p->in );
+			p->in = queue_pop_wait( &p->in_full );
+			p->in_pos = 0;
+			continue;
+		}
+		size_t n = p->in->size - p->in_pos;
+		if ( n > size )
+			n = size;
+		memcpy( dest, p->in->data + p->in_pos, n );
+		p->in_pos += n;
+		dest += n;
+		size -= n;
+	}
+	return 0;
+}
+
+// Skips size bytes of input. Returns 0 on success, 1 on a short read. The
+// bytes are read and thrown away rather than seeked past, since seeking
+// past the end of a truncated file doesn't fail and not every input can
+// seek.
+static int io_skip( struct dump_io *io, size_t size, char *scratch )
+{
+	while ( size > 0 )
+	{
+		size_t n = size < STREAM_CHUNK ? size : STREAM_CHUNK;
+		if ( io_read( io, scratch, n ) )
+			return 1;
+		size -= n;
+	}
+	return 0;
+}
+
+static void io_write( struct dump_io *io, const char *data, size_t size )
+{
+	if ( !io->pipe )
+	{
+		fwrite( data, sizeof (char), size, stdout );
+		return;
+	}
+
+	struct pipeline *p = io->pipe;
+	while ( size > 0 )
+	{
+		size_t n = PIPE_BUFFER_SIZE - p->out->size;
+		if ( n > size )
+			n = size;
+		memcpy( p->out->data + p->out->size, data, n );
+		p->out->size += n;
+		data += n;
+		size -= n;
+		if ( p->out->size == PIPE_BUFFER_SIZE )
+		{
+			queue_push_wait( &p->out_full, p->out );
+			p->out = queue_pop_wait( &p->out_free );
+			p->out->size = 0;
+		}
+	}
+}
+
+// Dumps the records from io one at a time. Values are read and escaped in
+// STREAM_CHUNK pieces, so the working set stays the same small size no
+// matter how large the file or its records are.
+static int stream_records( struct dump_context *ctx, const char *filename, struct dump_io *io,
+						   struct nvram_stats *stats, double *t_start )
+{
+	int file_format = ctx->file_format;
+	unsigned char header[8];
+	size_t header_size = ( file_format == FMT_DEFAULTS ) ? 4 : 8;
+	if ( io_read( io, header, header_size ) ||
+		 ( file_format != FMT_DEFAULTS && memcmp( header, "DD-WRT", 6 ) ) )
+	{
+		fprintf( stderr, "dump_file: File %s: Error reading header and record count\n", filename );
+		return 1;
+	}
+	unsigned int record_count = read_record_count( file_format, header );
+	stats->bytes_in = header_size;
+
+	// Room for escaping or JSON encoding, whichever can be longer.
+	// Up to 3 bytes of a UTF-8 sequence can be held over in front of a piece.
+	char *chunk = arena_alloc( &ctx->arena, STREAM_CHUNK + 3 );
+	size_t esc_max = ( STREAM_CHUNK + 3 ) * 6 + 1;
+	char *esc_chunk = arena_alloc( &ctx->arena, esc_max );
+	char *name = arena_alloc( &ctx->arena, 256 );
+	char *esc_name = arena_alloc( &ctx->arena, 255*6 + 1 );
+	size_t file_json_max = strlen( filename ) * 6 + 1;
+	char *file_json = arena_alloc( &ctx->arena, file_json_max );
+	if ( !chunk || !esc_chunk || !name || !esc_name || !file_json )
+	{
+		fprintf( stderr, "dump_file: File %s: Out of memory\n", filename );
+		return 1;
+	}
+	json_string( ESC_FULL, filename, strlen( filename ), file_json, file_json_max );
+	size_t file_json_len = strlen( file_json );
+	stats_phase_add( stats, PHASE_READ, t_start );
+
+	char prefix[JSON_RECORD_ROOM];
+	size_t prefix_len;
+	int first_member = 1;
+	if ( ctx->output == OUT_JSON_FILE )
+	{
+		io_write( io, "{\"file\":\"", 9 );
+		io_write( io, file_json, file_json_len );
+		io_write( io, "\",\"values\":{", 12 );
+		stats->bytes_out += file_json_len + 21;
+	}
+
+	// Text passes well-formed UTF-8 through with -u, and JSON always does
+	// unless it's writing every byte on its own.
+	int pass_utf8 = ( ctx->output == OUT_TEXT ) ? ( ctx->escape_mode & ESC_UTF8 ) :
+					( ctx->output != OUT_RAW && !( ctx->escape_mode & ESC_BYTES ) );
+	size_t len_size = ( file_format == FMT_DEFAULTS ) ? 1 : 2;
+	unsigned int record = 0, name_len, value_len;
+	unsigned char lenbuf[2];
+	int ret = 0;
+
+	while ( record < record_count )
+	{
+		record++;
+
+		// Read the 1-byte length and the variable name.
+		if ( io_read( io, lenbuf, 1 ) )
+		{
+			fprintf( stderr, "dump_file: File %s: Error reading name length from record %u\n",
+					 filename, record );
+			ret = 1;
+			break;
+		}
+		name_len = lenbuf[0];
+		if ( io_read( io, name, name_len ) )
+		{
+			fprintf( stderr, "dump_file: File %s: Error reading name from record %u\n",
+					 filename, record );
+			ret = 1;
+			break;
+		}
+		name[name_len] = 0;
+
+		// Read the length and the first piece of the value.
+		if ( io_read( io, lenbuf, len_size ) )
+		{
+			fprintf( stderr, "dump_file: File %s: Error reading value length from record %u\n",
+					 filename, record );
+			ret = 1;
+			break;
+		}
+		value_len = read_length( lenbuf, len_size );
+		size_t piece = value_len < STREAM_CHUNK ? value_len : STREAM_CHUNK;
+		if ( io_read( io, chunk, piece ) )
+		{
+			fprintf( stderr, "dump_file: File %s: Error reading value from record %u\n",
+					 filename, record );
+			ret = 1;
+			break;
+		}
+		stats->bytes_in += 1 + name_len + len_size + value_len;
+		stats_record( stats, 1 + name_len + len_size + value_len );
+		stats_phase_add( stats, PHASE_READ, t_start );
+
+		// Skip completely empty records, and values that begin with a NUL
+		// since everything after it is ignored.
+		size_t remaining = value_len - piece;
+		if ( ( strlen( name ) == 0 ) && ( piece == 0 || chunk[0] == 0 ) )
+		{
+			if ( remaining > 0 && io_skip( io, remaining, chunk ) )
+			{
+				fprintf( stderr, "dump_file: File %s: Error reading value from record %u\n",
+						 filename, record );
+				ret = 1;
+				break;
+			}
+			continue;
+		}
+		int redacted = ctx->redact && matcher_any( ctx->redact, name, strlen( name ) );
+
+		size_t esc_len;
+		if ( ctx->output == OUT_RAW )
+		{
+			esc_len = strlen( name );
+			name[esc_len] = '=';
+			io_write( io, name, esc_len + 1 );
+			stats->bytes_out += esc_len + 1;
+		}
+		else if ( ctx->output == OUT_TEXT )
+		{
+			escape_string( ESC_FULL, name, name_len, esc_name, 255*4 + 1 );
+			esc_len = strlen( esc_name );
+			if ( strlen( name ) < esc_len )
+				fprintf( stderr, "dump_file: File %s: Record %u: Name %s: contains non-printable characters\n",
+						 filename, record, esc_name );
+			stats_phase_add( stats, PHASE_ESCAPE, t_start );
+			esc_name[esc_len] = '=';
+			io_write( io, esc_name, esc_len + 1 );
+			stats->bytes_out += esc_len + 1;
+		}
+		else
+		{
+			json_string( ESC_FULL, name, name_len, esc_name, 255*6 + 1 );
+			esc_len = strlen( esc_name );
+			if ( strlen( name ) != esc_len )
+				warn_name( filename, record, name, strlen( name ) );
+			stats_phase_add( stats, PHASE_ESCAPE, t_start );
+			if ( ctx->output == OUT_JSON )
+			{
+				io_write( io, "{\"file\":\"", 9 );
+				io_write( io, file_json, file_json_len );
+				prefix_len = sprintf( prefix, "\",\"index\":%u,\"name\":\"", record - 1 );
+				stats->bytes_out += 9 + file_json_len;
+			}
+			else
+			{
+				prefix_len = sprintf( prefix, "%s\"", first_member ? "" : "," );
+				first_member = 0;
+			}
+			io_write( io, prefix, prefix_len );
+			io_write( io, esc_name, esc_len );
+			stats->bytes_out += prefix_len + esc_len;
+			if ( ctx->output == OUT_JSON )
+				prefix_len = sprintf( prefix, "\",\"value\":\"" );
+			else
+				prefix_len = sprintf( prefix, "\":\"" );
+			io_write( io, prefix, prefix_len );
+			stats->bytes_out += prefix_len;
+		}
+		stats_phase_add( stats, PHASE_OUTPUT, t_start );
+
+		// Escape and write the value a piece at a time. Output stops at the
+		// first NUL but the rest of the value still has to be read past.
+		// When UTF-8 is being passed through, a sequence split between two
+		// pieces is held over to the next one so it can be passed whole.
+		int at_nul = 0;
+		size_t hold;
+		if ( redacted )
+		{
+			// Write REDACTED in place of the value, then read past all of
+			// it the same as the rest of one after a NUL.
+			io_write( io, REDACTED, REDACTED_LEN );
+			stats->bytes_out += REDACTED_LEN;
+			at_nul = 1;
+		}
+		for ( ;; )
+		{
+			hold = 0;
+			if ( pass_utf8 && remaining > 0 )
+				hold = utf8_partial( (unsigned char *) chunk, piece );
+			if ( !at_nul )
+			{
+				size_t copied;
+				const char *out = esc_chunk;
+				if ( ctx->output == OUT_RAW )
+				{
+					copied = strnlen( chunk, piece - hold );
+					out = chunk;
+					esc_len = copied;
+				}
+				else
+				{
+					if ( ctx->output == OUT_TEXT )
+						copied = escape_string( ctx->escape_mode, chunk, piece - hold, esc_chunk, esc_max );
+					else
+						copied = json_string( ctx->escape_mode, chunk, piece - hold, esc_chunk, esc_max );
+					stats_phase_add( stats, PHASE_ESCAPE, t_start );
+					esc_len = strlen( esc_chunk );
+				}
+				if ( copied < piece - hold )
+					at_nul = 1;
+				io_write( io, out, esc_len );
+				stats->bytes_out += esc_len;
+				stats_phase_add( stats, PHASE_OUTPUT, t_start );
+			}
+			if ( remaining == 0 )
+				break;
+			memmove( chunk, chunk + piece - hold, hold );
+			piece = remaining < STREAM_CHUNK ? remaining : STREAM_CHUNK;
+			if ( io_read( io, chunk + hold, piece ) )
+			{
+				fprintf( stderr, "dump_file: File %s: Error reading value from record %u\n",
+						 filename, record );
+				ret = 1;
+				break;
+			}
+			remaining -= piece;
+			piece += hold;
+			stats_phase_add( stats, PHASE_READ, t_start );
+		}
+		if ( ctx->output == OUT_RAW )
+		{
+			prefix[0] = 0;
+			prefix_len = 1;
+		}
+		else if ( ctx->output == OUT_TEXT )
+			prefix_len = sprintf( prefix, "\n" );
+		else if ( ctx->output == OUT_JSON )
+			prefix_len = sprintf( prefix, "\"}\n" );
+		else
+			prefix_len = sprintf( prefix, "\"" );
+		io_write( io, prefix, prefix_len );
+		stats->bytes_out += prefix_len;
+		if ( ret )
+			break;
+	}
+	if ( ctx->output == OUT_JSON_FILE )
+	{
+		io_write( io, "}}\n", 3 );
+		stats->bytes_out += 3;
+	}
+	return ret;
+}
+
+// Finishes up the statistics for a file dumped by stream_records().
+static void stream_done( struct dump_context *ctx, const char *filename, struct nvram_stats *stats,
+						 double t_file )
+{
+	trace_span( "dump_file", "file", t_file, stats_now(), filename );
+	stats->files = 1;
+	if ( stats_enabled )
+		stats_report( stderr, filename, stats );
+	stats_add( &ctx->total, stats );
+}
+
+// Dumps a file one record at a time, reading it from f and writing the
+// output directly on the calling thread. Work on the file started at t_file.
+// Closes f.
+int dump_stream( struct dump_context *ctx, const char *filename, FILE *f, double t_file )
+{
+	struct nvram_stats stats;
+	stats_clear( &stats );
+	double t_start = t_file;
+
+	arena_reset( &ctx->arena );
+	struct dump_io io = { f, NULL };
+	int ret = stream_records( ctx, filename, &io, &stats, &t_start );
+	if ( compress_close( f ) != 0 )
+	{
+		fprintf( stderr, "dump_file: File %s: Error reading file\n", filename );
+		ret = 1;
+	}
+	if ( fflush( stdout ) != 0 )
+	{
+		fprintf( stderr, "dump_file: File %s: Error writing output\n", filename );
+		ret = 1;
+	}
+	stats_phase_add( &stats, PHASE_OUTPUT, &t_start );
+	stream_done( ctx, filename, &stats, t_file );
+	return ret;
+}
+
+static void *pipe_reader( void *arg )
+{
+	struct pipeline *p = arg;
+	struct pipe_buffer *b;
+	do
+	{
+		b = queue_pop_wait( &p->in_free );
+		double t = stats_now();
+		b->size = __atomic_load_n( &p->stop, __ATOMIC_ACQUIRE ) ? 0 :
+			fread( b->data, sizeof (char), PIPE_BUFFER_SIZE, p->f );
+		if ( b->size == 0 && ferror( p->f ) )
+			p->read_error = 1;
+		trace_span( "read", "pipeline", t, stats_now(), p->filename );
+		queue_push_wait( &p->in_full, b );
+	} while ( b->size > 0 );
+	return NULL;
+}
+
+static void *pipe_writer( void *arg )
+{
+	struct pipeline *p = arg;
+	struct pipe_buffer *b;
+	for ( ;; )
+	{
+		b = queue_pop_wait( &p->out_full );
+		if ( b->size == 0 )
+			break;
+		double t = stats_now();
+		if ( fwrite( b->data, sizeof (char), b->size, stdout ) != b->size )
+			p->write_error = 1;
+		trace_span( "output", "pipeline", t, stats_now(), p->filename );
+		queue_push_wait( &p->out_free, b );
+	}
+	if ( fflush( stdout ) != 0 )
+		p->write_error = 1;
+	return NULL;
+}
+
+// Tells the reader thread to stop and lets it run down, handing back the
+// buffers it's already filled, starting with p->in, until it sends the end
+// marker. Then waits for it to finish.
+static void pipe_stop_reader( struct pipeline *p, pthread_t reader )
+{
+	__atomic_store_n( &p->stop, 1, __ATOMIC_RELEASE );
+	while ( p->in->size > 0 )
+	{
+		queue_push_wait( &p->in_free, p->in );
+		p->in = queue_pop_wait( &p->in_full );
+	}
+	pthread_join( reader, NULL );
+}
+
+static void pipe_destroy( struct pipeline *p )
+{
+	queue_destroy( &p->in_full );
+	queue_destroy( &p->in_free );
+	queue_destroy( &p->out_full );
+	queue_destroy( &p->out_free );
+	free( p );
+}
+
+// Dumps a file with reading, escaping and writing overlapped on three
+// threads, so a large input takes about as long as the slowest of the
+// three rather than the sum. Otherwise the same as dump_stream().
+int dump_pipeline( struct dump_context *ctx, const char *filename, FILE *f, double t_file )
+{
+	struct nvram_stats stats;
+	stats_clear( &stats );
+	double t_start = t_file;
+
+	arena_reset( &ctx->arena );
+	// The queues keep their indexes on cache lines of their own, which
+	// needs more alignment than the arena gives.
+	struct pipeline *p = NULL;
+	char *memory = arena_alloc( &ctx->arena, PIPE_BUFFERS*2 * PIPE_BUFFER_SIZE );
+	if ( !memory || posix_memalign( (void **) &p, CACHE_LINE, sizeof (struct pipeline) ) != 0 )
+	{
+		fprintf( stderr, "dump_file: File %s: Out of memory\n", filename );
+		compress_close( f );
+		return 1;
+	}
+	memset( p, 0, sizeof (struct pipeline) );
+	p->f = f;
+	p->filename = filename;
+	queue_init( &p->in_full );
+	queue_init( &p->in_free );
+	queue_init( &p->out_full );
+	queue_init( &p->out_free );
+	int i;
+	for ( i = 0; i < PIPE_BUFFERS*2; i++ )
+	{
+		p->buffers[i].data = memory + i * PIPE_BUFFER_SIZE;
+		p->buffers[i].size = 0;
+		if ( i < PIPE_BUFFERS )
+			queue_push( &p->in_free, &p->buffers[i] );
+		else if ( i < PIPE_BUFFERS*2 - 1 )
+			queue_push( &p->out_free, &p->buffers[i] );
+	}
+	p->out = &p->buffers[PIPE_BUFFERS*2 - 1];
+
+	pthread_t reader, writer;
+	if ( pthread_create( &reader, NULL, pipe_reader, p ) != 0 )
+	{
+		fprintf( stderr, "dump_file: File %s: Cannot start reader thread\n", filename );
+		pipe_destroy( p );
+		compress_close( f );
+		return 1;
+	}
+	p->in = queue_pop_wait( &p->in_full );
+	p->in_pos = 0;
+	if ( pthread_create( &writer, NULL, pipe_writer, p ) != 0 )
+	{
+		fprintf( stderr, "dump_file: File %s: Cannot start writer thread\n", filename );
+		pipe_stop_reader( p, reader );
+		pipe_destroy( p );
+		compress_close( f );
+		return 1;
+	}
+
+	struct dump_io io = { NULL, p };
+	int ret = stream_records( ctx, filename, &io, &stats, &t_start );
+
+	// Stop the reader, then hand the writer what's left of the output and
+	// the end marker.
+	pipe_stop_reader( p, reader );
+	if ( p->out->size > 0 )
+	{
+		queue_push_wait( &p->out_full, p->out );
+		p->out = queue_pop_wait( &p->out_free );
+	}
+	p->out->size = 0;
+	queue_push_wait( &p->out_full, p->out );
+	pthread_join( writer, NULL );
+	if ( compress_close( f ) != 0 )
+		p->read_error = 1;
+
+	if ( p->read_error )
+	{
+		fprintf( stderr, "dump_file: File %s: Error reading file\n", filename );
+		ret = 1;
+	}
+	if ( p->write_error )
+	{
+		fprintf( stderr, "dump_file: File %s: Error writing output\n", filename );
+		ret = 1;
+	}
+	pipe_destroy( p );
+	stats_phase_add( &stats, PHASE_OUTPUT, &t_start );
+	stream_done( ctx, filename, &stats, t_file );
+	return ret;
+}
+
+// A range of records escaped as one piece of work, into its own part of
+// the output buffer.
+struct escape_chunk
+{
+	unsigned int first;		// Records first up to but not including last
+	unsigned int last;
+	char *output;
+	size_t used;			// Bytes of output produced
+	unsigned long long hash;	// Sum of the record hashes for --fingerprint
+};
+
+// The chunks of one file, shared by the threads escaping them. Each thread
+// takes the next chunk not yet claimed until they're all done.
+struct escape_job
+{
+	struct dump_context *ctx;
+	const char *filename;
+	const char *file_json;		// filename encoded for JSON output
+	size_t file_json_len;
+	const struct nvram_record *records;
+	const unsigned int *index;	// Each record's number in the file, if sorted
+	struct escape_chunk *chunks;
+	unsigned int chunk_count;
+	unsigned int next_chunk;
+};
+
+// Number in the file of the job's record'th record.
+static inline unsigned int record_number( const struct escape_job *job, unsigned int record )
+{
+	return job->index ? job->index[record] : record;
+}
+
+// Escapes records [first, last) into output as name=value lines. Returns
+// the number of bytes written; output must have room for four times the
+// length of every name and value plus three bytes per record.
+static size_t escape_records( const struct escape_job *job, unsigned int first, unsigned int last,
+							  char *output )
+{
+	const char *filename = job->filename;
+	int escape_mode = job->ctx->escape_mode;
+	size_t out_used = 0;
+	unsigned int record;
+	for ( record = first; record < last; record++ )
+	{
+		const struct nvram_record *r = &job->records[record];
+		unsigned int number = record_number( job, record );
+		size_t name_len = strnlen( r->name, r->name_len );
+		size_t value_len = strnlen( r->value, r->value_len );
+
+		// Skip completely empty records
+		if ( ( name_len == 0 ) && ( value_len == 0 ) )
+			continue;
+		const char *value = redact_value( job->ctx, r->name, name_len, r->value, &value_len );
+
+		char *esc_name = output + out_used;
+		size_t copied;
+
+		copied = escape_string( ESC_FULL, r->name, name_len, esc_name, name_len * 4 + 1 );
+		size_t esc_name_len = strlen( esc_name );
+		if ( copied < name_len )
+			fprintf( stderr, "dump_file: File %s: Record %u: cannot copy entire name %s\n",
+					 filename, number+1, esc_name );
+		else if ( name_len < esc_name_len )
+			fprintf( stderr, "dump_file: File %s: Record %u: Name %s: contains non-printable characters\n",
+					 filename, number+1, esc_name );
+		out_used += esc_name_len;
+		output[out_used++] = '=';
+
+		copied = escape_string( escape_mode, value, value_len, output + out_used, value_len * 4 + 1 );
+		if ( copied < value_len )
+			fprintf( stderr, "dump_file: File %s: Record %u: Name %.*s: cannot copy entire value\n",
+					 filename, number+1, (int) esc_name_len, esc_name );
+		out_used += strlen( output + out_used );
+		output[out_used++] = '\n';
+	}
+	return out_used;
+}
+
+// Encodes records [first, last) into output as JSON, either a line per
+// record or, for OUT_JSON_FILE, members of the file's object each preceded
+// by a comma. Returns the number of bytes written; output must have room
+// for record_room() bytes per record.
+static size_t json_records( const struct escape_job *job, unsigned int first, unsigned int last,
+							char *output )
+{
+	size_t out_used = 0;
+	unsigned int record;
+	for ( record = first; record < last; record++ )
+	{
+		const struct nvram_record *r = &job->records[record];
+		size_t name_len = strnlen( r->name, r->name_len );
+		size_t value_len = strnlen( r->value, r->value_len );
+
+		// Skip completely empty records
+		if ( ( name_len == 0 ) && ( value_len == 0 ) )
+			continue;
+		const char *value = redact_value( job->ctx, r->name, name_len, r->value, &value_len );
+
+		if ( job->ctx->output == OUT_JSON )
+		{
+			memcpy( output + out_used, "{\"file\":\"", 9 );
+			out_used += 9;
+			memcpy( output + out_used, job->file_json, job->file_json_len );
+			out_used += job->file_json_len;
+			out_used += sprintf( output + out_used, "\",\"index\":%u,\"name\":\"",
+								 record_number( job, record ) );
+		}
+		else
+		{
+			memcpy( output + out_used, ",\"", 2 );
+			out_used += 2;
+		}
+
+		json_string( ESC_FULL, r->name, name_len, output + out_used, name_len * 6 + 1 );
+		size_t json_name_len = strlen( output + out_used );
+		if ( json_name_len != name_len )
+			warn_name( job->filename, record_number( job, record ) + 1, r->name, name_len );
+		out_used += json_name_len;
+
+		if ( job->ctx->output == OUT_JSON )
+		{
+			memcpy( output + out_used, "\",\"value\":\"", 11 );
+			out_used += 11;
+		}
+		else
+		{
+			memcpy( output + out_used, "\":\"", 3 );
+			out_used += 3;
+		}
+		json_string( job->ctx->escape_mode, value, value_len, output + out_used, value_len * 6 + 1 );
+		out_used += strlen( output + out_used );
+		if ( job->ctx->output == OUT_JSON )
+		{
+			memcpy( output + out_used, "\"}\n", 3 );
+			out_used += 3;
+		}
+		else
+			output[out_used++] = '"';
+	}
+	return out_used;
+}
+
+// Copies records [first, last) into output as name=value entries each ended
+// by a NUL, with nothing escaped. Returns the number of bytes written;
+// output must have room for record_room() bytes per record.
+static size_t raw_records( const struct escape_job *job, unsigned int first, unsigned int last,
+						   char *output )
+{
+	size_t out_used = 0;
+	unsigned int record;
+	for ( record = first; record < last; record++ )
+	{
+		const struct nvram_record *r = &job->records[record];
+		size_t name_len = strnlen( r->name, r->name_len );
+		size_t value_len = strnlen( r->value, r->value_len );
+
+		// Skip completely empty records
+		if ( ( name_len == 0 ) && ( value_len == 0 ) )
+			continue;
+		const char *value = redact_value( job->ctx, r->name, name_len, r->value, &value_len );
+
+		memcpy( output + out_used, r->name, name_len );
+		out_used += name_len;
+		output[out_used++] = '=';
+		memcpy( output + out_used, value, value_len );
+		out_used += value_len;
+		output[out_used++] = 0;
+	}
+	return out_used;
+}
+
+// Adds up the record_hash() of records [first, last) for --fingerprint,
+// skipping empty ones and hiding --redact values the same as the other
+// outputs, and returns the sum.
+// With OUT_FINGERPRINT_KEYS each record's hash is also written into output
+// as a name=hash line, and *used set to the number of bytes written; output
+// must have room for record_room() bytes per record.
+static unsigned long long fingerprint_records( const struct escape_job *job, unsigned int first,
+											   unsigned int last, char *output, size_t *used )
+{
+	unsigned long long sum = 0;
+	size_t out_used = 0;
+	unsigned int record;
+	for ( record = first; record < last; record++ )
+	{
+		const struct nvram_record *r = &job->records[record];
+		size_t name_len = strnlen( r->name, r->name_len );
+		size_t value_len = strnlen( r->value, r->value_len );
+
+		// Skip completely empty records
+		if ( ( name_len == 0 ) && ( value_len == 0 ) )
+			continue;
+		const char *value = redact_value( job->ctx, r->name, name_len, r->value, &value_len );
+
+		unsigned long long hash = record_hash( r->name, name_len, value, value_len );
+		sum += hash;
+		if ( job->ctx->output == OUT_FINGERPRINT_KEYS )
+		{
+			char *esc_name = output + out_used;
+			escape_string( ESC_FULL, r->name, name_len, esc_name, name_len * 4 + 1 );
+			size_t esc_name_len = strlen( esc_name );
+			if ( name_len < esc_name_len )
+				fprintf( stderr, "dump_file: File %s: Record %u: Name %s: contains non-printable characters\n",
+						 job->filename, record_number( job, record ) + 1, esc_name );
+			out_used += esc_name_len;
+			out_used += sprintf( output + out_used, "=%016llx\n", hash );
+		}
+	}
+	*used = out_used;
+	return sum;
+}
+
+// Most bytes of output record can need, including the terminating NUL
+// escape_string() or json_string() leaves after the value. Escaping can
+// at most quadruple the length of a string and JSON encoding can make it
+// six times as long. A value --redact hides can be shorter than REDACTED.
+static size_t record_room( const struct escape_job *job, const struct nvram_record *r )
+{
+	size_t len = r->name_len + r->value_len;
+	if ( job->ctx->redact && r->value_len < REDACTED_LEN )
+		len += REDACTED_LEN;
+	if ( job->ctx->output == OUT_JSON )
+		return len * 6 + job->file_json_len + JSON_RECORD_ROOM;
+	if ( job->ctx->output == OUT_JSON_FILE )
+		return len * 6 + 7; // ,"name":"value" and the NUL
+	if ( job->ctx->output == OUT_RAW )
+		return len + 2; // The '=' and the NUL
+	if ( job->ctx->output == OUT_FINGERPRINT_KEYS )
+		return r->name_len * 4 + 19; // The '=', the hash, the newline and the NUL
+	if ( job->ctx->output == OUT_FINGERPRINT )
+		return len; // Nothing's written, but chunks are balanced by this
+	return len * 4 + 3; // The '=', the newline and the NUL
+}
+
+static void *escape_worker( void *arg )
+{
+	struct escape_job *job = arg;
+	unsigned int chunk;
+	while ( ( chunk = __atomic_fetch_add( &job->next_chunk, 1, __ATOMIC_RELAXED ) ) < job->chunk_count )
+	{
+		struct escape_chunk *c = &job->chunks[chunk];
+		double t = stats_now();
+		if ( job->ctx->output == OUT_TEXT )
+			c->used = escape_records( job, c->first, c->last, c->output );
+		else if ( job->ctx->output == OUT_RAW )
+			c->used = raw_records( job, c->first, c->last, c->output );
+		else if ( job->ctx->output == OUT_FINGERPRINT || job->ctx->output == OUT_FINGERPRINT_KEYS )
+			c->hash = fingerprint_records( job, c->first, c->last, c->output, &c->used );
+		else
+			c->used = json_records( job, c->first, c->last, c->output );
+		trace_span( stats_escape_name, "chunk", t, stats_now(), job->filename );
+	}
+	return NULL;
+}
+
+// Dumps a backup that's already been read into memory. Work on the file
+// started at t_file, and everything up to now is counted as reading it.
+// Memory for the records and output comes from ctx's arena, which the
+// caller resets before reading the file.
+int dump_buffer( struct dump_context *ctx, const char *filename,
+				 const unsigned char *buffer, size_t size, double t_file )
+{
+	int file_format = ctx->file_format;
+	struct nvram_stats stats;
+	stats_clear( &stats );
+	double t_start = t_file;
+
+	stats.bytes_in = size;
+	stats_phase_end( &stats, PHASE_READ, &t_start, filename );
+
+	unsigned int record_count = 0;
+	size_t flash_end = 0;
+	int flash_sts = 0;
+
+	if ( is_flash( buffer, size ) )
+	{
+		// An image of the partition in flash. Its strings are counted to
+		// find the number of records, which the header doesn't have.
+		char problem[128];
+		flash_sts = flash_header( buffer, size, &flash_end, problem, sizeof problem );
+		if ( flash_sts != 0 )
+			fprintf( stderr, "dump_file: File %s: %s\n", filename, problem );
+		if ( flash_sts < 0 )
+			return 1;
+		file_format = FMT_FLASH;
+		size_t pos;
+		record_count = walk_flash( buffer, flash_end, &pos, NULL );
+	}
+	else if ( ( file_format == FMT_DEFAULTS && size < 4 ) ||
+			  ( file_format != FMT_DEFAULTS && ( size < 8 || memcmp( buffer, "DD-WRT", 6 ) ) ) )
+	{
+		fprintf( stderr, "dump_file: File %s: Error reading header and record count\n", filename );
+		return 1;
+	}
+	else
+		record_count = read_record_count( file_format, buffer );
+
+	struct nvram_record *records = arena_alloc( &ctx->arena, ( record_count + 1 ) * sizeof (struct nvram_record) );
+	if ( !records )
+	{
+		fprintf( stderr, "dump_file: File %s: Out of memory\n", filename );
+		return 1;
+	}
+	int ret;
+	unsigned int found;
+	if ( file_format == FMT_FLASH )
+	{
+		size_t pos;
+		found = walk_flash( buffer, flash_end, &pos, records );
+		ret = flash_sts;
+	}
+	else if ( ctx->threads > 1 && size >= SPECULATE_MIN_SIZE )
+		found = walk_records_parallel( file_format, filename, ctx->threads, buffer, size,
+									   record_count, records, &ret );
+	else
+	{
+		size_t pos = ( file_format == FMT_DEFAULTS ) ? 4 : 8;
+		found = walk_records( file_format, filename, buffer, size, &pos, 0, record_count, records, &ret );
+	}
+
+	struct escape_job job = { ctx, filename, NULL, 0, records, NULL, NULL, 0, 0 };
+	char *file_json = NULL;
+	if ( ctx->output == OUT_JSON || ctx->output == OUT_JSON_FILE )
+	{
+		size_t max = strlen( filename ) * 6 + 1;
+		file_json = arena_alloc( &ctx->arena, max );
+		if ( !file_json )
+		{
+			fprintf( stderr, "dump_file: File %s: Out of memory\n", filename );
+			return 1;
+		}
+		json_string( ESC_FULL, filename, strlen( filename ), file_json, max );
+		job.file_json = file_json;
+		job.file_json_len = strlen( file_json );
+	}
+
+	// Work out how much room each record can need once escaped.
+	unsigned int record;
+	size_t total = 0;
+	for ( record = 0; record < found; record++ )
+	{
+		const struct nvram_record *r = &records[record];
+		if ( file_format == FMT_FLASH )
+			stats_record( &stats, r->name_len + r->value_len + 2 ); // The '=' and the NUL
+		else
+			stats_record( &stats, 1 + r->name_len + ( ( file_format == FMT_DEFAULTS ) ? 1 : 2 ) + r->value_len );
+		total += record_room( &job, r );
+	}
+
+	// Sorting only ever takes records away, so total is still enough room.
+	if ( ctx->sort != SORT_NONE )
+	{
+		unsigned int *index;
+		int kept = sort_records( &ctx->arena, ctx->sort, records, found, &index );
+		if ( kept < 0 )
+		{
+			fprintf( stderr, "dump_file: File %s: Out of memory\n", filename );
+			return 1;
+		}
+		found = kept;
+		job.index = index;
+	}
+	stats_phase_end( &stats, PHASE_PARSE, &t_start, filename );
+
+	// Split the records into chunks of about the same escaped size, so one
+	// big certificate doesn't leave the other threads idle. Small files
+	// aren't worth starting threads for and are done as a single chunk.
+	unsigned int chunk_count = 1;
+	if ( ctx->threads > 1 && size >= PARALLEL_MIN_SIZE )
+		chunk_count = ctx->threads * CHUNKS_PER_THREAD;
+	if ( chunk_count > found )
+		chunk_count = found ? found : 1;
+	struct escape_chunk *chunks = arena_alloc( &ctx->arena, chunk_count * sizeof (struct escape_chunk) );
+	char *output = arena_alloc( &ctx->arena, total + 1 );
+	if ( !chunks || !output )
+	{
+		fprintf( stderr, "dump_file: File %s: Out of memory\n", filename );
+		return 1;
+	}
+	unsigned int chunk = 0;
+	size_t offset = 0, target = total / chunk_count + 1;
+	chunks[0].first = 0;
+	chunks[0].output = output;
+	for ( record = 0; record < found; record++ )
+	{
+		offset += record_room( &job, &records[record] );
+		if ( offset >= target * ( chunk + 1 ) && chunk + 1 < chunk_count )
+		{
+			chunks[chunk].last = record + 1;
+			chunk++;
+			chunks[chunk].first = record + 1;
+			chunks[chunk].output = output + offset;
+		}
+	}
+	chunks[chunk].last = found;
+	chunk_count = chunk + 1;
+
+	job.chunks = chunks;
+	job.chunk_count = chunk_count;
+	if ( chunk_count > 1 )
+		run_threads( ctx->threads, escape_worker, &job );
+	else
+		escape_worker( &job );
+	stats_phase_end( &stats, PHASE_ESCAPE, &t_start, filename );
+
+	// With one JSON object per file the records are its members, each after
+	// a comma that the first one doesn't need.
+	size_t out_used = 0;
+	int skip = 0;
+	if ( ctx->output == OUT_JSON_FILE )
+	{
+		out_used += printf( "{\"file\":\"%s\",\"values\":{", file_json );
+		skip = 1;
+	}
+	for ( chunk = 0; chunk < chunk_count; chunk++ )
+	{
+		const char *data = chunks[chunk].output;
+		size_t used = chunks[chunk].used;
+		if ( skip && used > 0 )
+		{
+			data++;
+			used--;
+			skip = 0;
+		}
+		if ( fwrite( data, sizeof (char), used, stdout ) != used )
+		{
+			fprintf( stderr, "dump_file: File %s: Error writing output\n", filename );
+			ret = 1;
+			break;
+		}
+		out_used += used;
+	}
+	if ( ctx->output == OUT_JSON_FILE )
+		out_used += printf( "}}\n" );
+	else if ( ctx->output == OUT_FINGERPRINT || ctx->output == OUT_FINGERPRINT_KEYS )
+	{
+		// Addition doesn't care what order the records were in.
+		unsigned long long hash = 0;
+		for ( chunk = 0; chunk < chunk_count; chunk++ )
+			hash += chunks[chunk].hash;
+		// A hash of only the records before a problem would look like a
+		// real one, so a damaged file gets a line of its own.
+		if ( ret != 0 )
+			out_used += printf( "FAILED            %s\n", filename );
+		else
+			out_used += printf( "%016llx  %s\n", hash, filename );
+	}
+	fflush( stdout );
+	stats.bytes_out = out_used;
+	stats_phase_end( &stats, PHASE_OUTPUT, &t_start, filename );
+	trace_span( "dump_file", "file", t_file, t_start, filename );
+
+	stats.files = 1;
+	if ( stats_enabled )
+		stats_report( stderr, filename, &stats );
+	stats_add( &ctx->total, &stats );
+
+	return ret;
+}
+
+// Dumps every regular file in a tar archive being read from f, each after a
+// "==> archive:member <==" line, and closes f. The first header block has
+// already been read. Members are read whole, and may be compressed on
+// their own. If keep is set the arena holds data that has to stay, so it
+// isn't reset between members. Returns 0 if every member was dumped, 1
+// otherwise.
+static int dump_tar( struct dump_context *ctx, const char *filename, FILE *f, const unsigned char *first,
+					 int keep )
+{
+	struct tar_reader t;
+	int sts, ret = 0;
+	double t_file = stats_now();
+
+	tar_open( &t, f, first );
+	while ( ( sts = tar_next( &t ) ) > 0 )
+	{
+		if ( !keep )
+			arena_reset( &ctx->arena );
+		size_t label_len = strlen( filename ) + strlen( t.name ) + 2;
+		char *label = arena_alloc( &ctx->arena, label_len );
+		if ( label )
+			snprintf( label, label_len, "%s:%s", filename, t.name );
+		if ( label && t.size > TAR_MEMBER_MAX )
+		{
+			fprintf( stderr, "dump_file: File %s: Too big at %llu bytes\n", label, t.size );
+			ret = 1;
+			t_file = stats_now();
+			continue;
+		}
+		char *buffer = label ? arena_alloc( &ctx->arena, t.size + 1 ) : NULL;
+		if ( !buffer )
+		{
+			fprintf( stderr, "dump_file: File %s: Out of memory\n", filename );
+			ret = 1;
+			break;
+		}
+		size_t size = t.size;
+		if ( tar_read( &t, buffer, size ) != size )
+		{
+			fprintf( stderr, "dump_file: File %s: Error reading file\n", label );
+			ret = 1;
+			break;
+		}
+		buffer[size] = 0;
+		if ( compress_detect( (unsigned char *) buffer, size ) != COMPRESS_NONE )
+		{
+			buffer = compress_decode( &ctx->arena, label, buffer, size, &size );
+			if ( !buffer )
+			{
+				fprintf( stderr, "dump_file: File %s: Error reading file\n", label );
+				ret = 1;
+				t_file = stats_now();
+				continue;
+			}
+		}
+
+		// JSON output has the member's name in it already, and raw output
+		// has nowhere to put it.
+		if ( ctx->output == OUT_TEXT )
+			printf( "==> %s <==\n", label );
+		if ( dump_buffer( ctx, label, (unsigned char *) buffer, size, t_file ) != 0 )
+			ret = 1;
+		t_file = stats_now();
+	}
+	if ( sts < 0 )
+	{
+		fprintf( stderr, "dump_file: File %s: Corrupt or truncated tar archive\n", filename );
+		ret = 1;
+	}
+	if ( compress_close( f ) != 0 )
+		ret = 1;
+	return ret;
+}
+
+int dump_file( struct dump_context *ctx, const char *filename )
+{
+	if ( !filename || ( strlen( filename ) == 0 ) )
+	{
+		fprintf( stderr, "dump_file: No filename given\n" );
+		return 1;
+	}
+
+	double t_file = stats_now();
+
+	FILE *f = compress_open( filename );
+	if ( !f )
+	{
+		int code = errno;
+		char *errstr = strerror( code );
+		fprintf( stderr, "dump_file: Error opening %s: %s\n", filename, errstr );
+		return 1;
+	}
+
+	// A tar archive is recognized by its first header block. Anything else
+	// gets those bytes put back and is dumped as a backup.
+	unsigned char block[TAR_BLOCK];
+	size_t n = fread( block, sizeof (char), TAR_BLOCK, f );
+	if ( tar_is_header( block, n ) )
+		return dump_tar( ctx, filename, f, block, 0 );
+	f = compress_unread( f, filename, block, n );
+	if ( !f )
+	{
+		fprintf( stderr, "dump_file: File %s: Error reading file: %s\n", filename, strerror( errno ) );
+		return 1;
+	}
+	// Flash images are small and their records can't be found one at a
+	// time the way a backup's are, so they're always read whole.
+	if ( ctx->pipeline && !is_flash( block, n ) )
+		return dump_pipeline( ctx, filename, f, t_file );
+	if ( ctx->stream && !is_flash( block, n ) )
+		return dump_stream( ctx, filename, f, t_file );
+
+	// Read the whole backup in one go. Backups are small, and having it all in
+	// memory lets the record walk, the escaping and the output each run as a
+	// single pass.
+	arena_reset( &ctx->arena );
+	size_t size = 0;
+	unsigned char *buffer = (unsigned char *) arena_read_file( &ctx->arena, f, &size );
+	if ( compress_close( f ) != 0 )
+		buffer = NULL;
+	if ( !buffer )
+	{
+		fprintf( stderr, "dump_file: File %s: Error reading file\n", filename );
+		return 1;
+	}
+	return dump_buffer( ctx, filename, buffer, size, t_file );
+}
+
+// Dumps count files using the batch reader, which keeps up to depth of
+// them being opened and read while earlier ones are dumped. Returns 0 if
+// every file was dumped, 1 otherwise.
+int dump_batch( struct dump_context *ctx, char **filenames, int count, int depth )
+{
+	struct batch_reader *r = batch_open( filenames, count, depth );
+	if ( !r )
+	{
+		fprintf( stderr, "dump_batch: Out of memory\n" );
+		return 1;
+	}
+
+	const char *filename;
+	char *data;
+	size_t size;
+	int sts, stage, ret = 0;
+	double t_file = stats_now();
+	while ( ( sts = batch_next( r, &filename, &data, &size, &stage ) ) >= 0 )
+	{
+		if ( sts != 0 )
+		{
+			if ( stage == BATCH_OPEN )
+				fprintf( stderr, "dump_file: Error opening %s: %s\n", filename, strerror( sts ) );
+			else
+				fprintf( stderr, "dump_file: File %s: Error reading file: %s\n", filename, strerror( sts ) );
+			ret = 1;
+		}
+		else
+		{
+			arena_reset( &ctx->arena );
+			// Compressed files are decompressed in memory once they're read.
+			if ( compress_detect( (unsigned char *) data, size ) != COMPRESS_NONE )
+				data = compress_decode( &ctx->arena, filename, data, size, &size );
+			if ( !data )
+			{
+				fprintf( stderr, "dump_file: File %s: Error reading file\n", filename );
+				ret = 1;
+			}
+			else if ( tar_is_header( (unsigned char *) data, size ) )
+			{
+				// The whole archive is already in memory, so read it from there.
+				FILE *f = fmemopen( data, size, "rb" );
+				if ( !f || dump_tar( ctx, filename, f, NULL, 1 ) != 0 )
+					ret = 1;
+			}
+			else if ( dump_buffer( ctx, filename, (unsigned char *) data, size, t_file ) != 0 )
+				ret = 1;
+		}
+		t_file = stats_now();
+	}
+	batch_close( r );
+	return ret;
+}
+
+// Follows the chain of records in buffer for --check, without keeping or
+// copying any of them. Writes a line to out saying the backup called name
+// is sound, unless quiet is set, or what the first thing wrong with it is
+// and the offset where it was found. Returns 0 if it's sound, 1 otherwise.
+static int check_buffer( int file_format, const char *name, const unsigned char *buffer, size_t size,
+						 FILE *out, int quiet )
+{
+	size_t pos = ( file_format == FMT_DEFAULTS ) ? 4 : 8;
+	unsigned int record_count, record;
+
+	if ( is_flash( buffer, size ) )
+	{
+		char problem[128];
+		size_t end;
+		if ( flash_header( buffer, size, &end, problem, sizeof problem ) != 0 )
+		{
+			fprintf( out, "%s: FAILED: %s\n", name, problem );
+			return 1;
+		}
+		record_count = walk_flash( buffer, end, &pos, NULL );
+		if ( pos >= end )
+		{
+			fprintf( out, "%s: FAILED: Strings aren't ended by an empty one before offset %zu\n",
+					 name, end );
+			return 1;
+		}
+		if ( !quiet )
+			fprintf( out, "%s: OK, flash image, %u records\n", name, record_count );
+		return 0;
+	}
+	if ( size < pos || ( file_format != FMT_DEFAULTS && memcmp( buffer, "DD-WRT", 6 ) != 0 ) )
+	{
+		fprintf( out, "%s: FAILED: Missing or bad header at offset 0\n", name );
+		return 1;
+	}
+	record_count = read_record_count( file_format, buffer );
+
+	for ( record = 0; record < record_count; record++ )
+	{
+		struct nvram_record r;
+		int broken;
+		size_t next = parse_record( file_format, buffer, size, pos, &r, &broken );
+		if ( next )
+		{
+			pos = next;
+			continue;
+		}
+		fprintf( out, "%s: FAILED: Record %u of %u: ", name, record+1, record_count );
+		size_t name_pos = pos + 1;
+		switch ( broken )
+		{
+		case BROKEN_NAME_LENGTH:
+			fprintf( out, "Name length past the end of the file at offset %zu\n", pos );
+			break;
+		case BROKEN_NAME:
+			fprintf( out, "Name of %u bytes at offset %zu runs past the end of the file\n",
+					 r.name_len, name_pos );
+			break;
+		case BROKEN_VALUE_LENGTH:
+			fprintf( out, "Value length past the end of the file at offset %zu\n", name_pos + r.name_len );
+			break;
+		default:
+			fprintf( out, "Value of %u bytes at offset %zu runs past the end of the file\n",
+					 r.value_len, (size_t) ( (const unsigned char *) r.value - buffer ) );
+			break;
+		}
+		return 1;
+	}
+	if ( pos < size )
+	{
+		fprintf( out, "%s: FAILED: %zu bytes after record %u of %u at offset %zu\n",
+				 name, size - pos, record_count, record_count, pos );
+		return 1;
+	}
+	if ( !quiet )
+		fprintf( out, "%s: OK, %u records\n", name, record_count );
+	return 0;
+}
 
-// File format
-#define FMT_NVRAM		0
-#define FMT_DEFAULTS	1
+// Lint checks, what a --lint rule requires of the values of the entries
+// its pattern matches.
+#define LINT_MAX_LENGTH	0	// No longer than length bytes
+#define LINT_MIN_LENGTH	1	// At least length bytes
+#define LINT_MATCH		2	// Matches the regular expression
+#define LINT_NO_MATCH	3	// Doesn't match the regular expression
+#define LINT_FORBID		4	// Contains none of the forbidden bytes
+#define LINT_UNIQUE		5	// The name appears only once
 
+struct lint_rule
+{
+	int check;
+	int line;					// Line of the rules file it came from
+	unsigned long length;
+	regex_t regex;
+	unsigned char forbid[256];	// Non-zero for each byte forbidden
+};
 
-// Returns the number of characters copied to dest.
-int escape_string( int escape_mode, const char *src, char *dest, int max )
+// A --lint rules file, compiled. Rules are numbered by their place in
+// rules[], which is also their id in the matcher.
+struct lint_rules
 {
-	if ( !src || !dest || max <= 0 )
-		return 0;
+	const char *filename;
+	struct lint_rule *rules;
+	int count;
+	struct matcher *matcher;
+};
 
-	char tmpbuf[8]; // Long enough for longest single escape sequence
+// Reads the bytes forbid's argument gives into forbid[]. Besides plain
+// characters it takes \n, \r, \t, \\ and \xNN, the escapes nvram_dump
+// writes, so that spaces and control characters can be given.
+static int lint_forbid( const char *arg, unsigned char *forbid )
+{
+	const unsigned char *p = (const unsigned char *) arg;
+	while ( *p )
+	{
+		unsigned int c = *p++;
+		if ( c == '\\' )
+		{
+			c = *p++;
+			if ( c == 'n' )
+				c = '\n';
+			else if ( c == 'r' )
+				c = '\r';
+			else if ( c == 't' )
+				c = '\t';
+			else if ( c == 'x' && isxdigit( p[0] ) && isxdigit( p[1] ) )
+			{
+				char hex[3] = { p[0], p[1], 0 };
+				c = strtoul( hex, NULL, 16 );
+				p += 2;
+			}
+			else if ( c != '\\' )
+				return -1;
+		}
+		forbid[c] = 1;
+	}
+	return 0;
+}
+
+void lint_free( struct lint_rules *l )
+{
+	int i;
+	for ( i = 0; i < l->count; i++ )
+		if ( l->rules[i].check == LINT_MATCH || l->rules[i].check == LINT_NO_MATCH )
+			regfree( &l->rules[i].regex );
+	free( l->rules );
+	matcher_free( l->matcher );
+}
+
+// Reads and compiles the rules file filename for --lint. Each line is a
+// name pattern, a check and the check's argument if it has one, separated
+// by spaces, or blank, or a comment starting with '#'. Returns 0 on success
+// or 1 if the file can't be read or has a mistake in it.
+int lint_load( struct lint_rules *l, const char *filename )
+{
+	memset( l, 0, sizeof (struct lint_rules) );
+	l->filename = filename;
+	FILE *f = fopen( filename, "r" );
+	if ( !f )
+	{
+		fprintf( stderr, "lint_load: Error opening %s: %s\n", filename, strerror( errno ) );
+		return 1;
+	}
+	l->matcher = matcher_new( 0 );
+	if ( !l->matcher )
+	{
+		fprintf( stderr, "lint_load: Out of memory\n" );
+		fclose( f );
+		return 1;
+	}
 
-	int i, j = 0, len = strlen( src );
-	for ( i = 0; i < len; i++ )
+	char *line = NULL;
+	size_t allocated = 0;
+	int line_number = 0, ret = 0, rules_allocated = 0;
+	ssize_t len;
+	while ( ret == 0 && ( len = getline( &line, &allocated, f ) ) >= 0 )
 	{
-		if ( isascii( src[i] ) )
+		line_number++;
+		while ( len > 0 && isspace( (unsigned char) line[len-1] ) )
+			line[--len] = 0;
+		char *pattern = line + strspn( line, " \t" );
+		if ( *pattern == 0 || *pattern == '#' )
+			continue;
+		char *check = pattern + strcspn( pattern, " \t" );
+		size_t pattern_len = check - pattern;
+		check += strspn( check, " \t" );
+		char *arg = check + strcspn( check, " \t" );
+		if ( *arg )
+		{
+			*arg++ = 0;
+			arg += strspn( arg, " \t" );
+		}
+
+		if ( l->count == rules_allocated )
 		{
-			if ( iscntrl( src[i] ) )
+			rules_allocated = rules_allocated ? rules_allocated * 2 : 16;
+			struct lint_rule *rules = realloc( l->rules, rules_allocated * sizeof (struct lint_rule) );
+			if ( !rules )
 			{
-				if ( src[i] == '\n' )
-				{
-					if ( escape_mode == ESC_HUMAN )
-						strcpy( tmpbuf, "\\\n" );
-					else
-						strcpy( tmpbuf, "\\n" );
-				}
-				else if ( src[i] == '\a' )
-					strcpy( tmpbuf, "\\a" );
-				else if ( src[i] == '\b' )
-					strcpy( tmpbuf, "\\b" );
-				else if ( src[i] == '\f' )
-					strcpy( tmpbuf, "\\f" );
-				else if ( src[i] == '\r' )
-					strcpy( tmpbuf, "\\r" );
-				else if ( src[i] == '\t' )
-					strcpy( tmpbuf, "\\t" );
-				else if ( src[i] == '\v' )
-					strcpy( tmpbuf, "\\v" );
-				else
-					sprintf( tmpbuf, "\\x%02.2X", (unsigned int) ( src[i] & 0xFF ) );
+				fprintf( stderr, "lint_load: Out of memory\n" );
+				ret = 1;
+				break;
 			}
-			else if ( src[i] == '\\' )
-				strcpy( tmpbuf, "\\\\" );
-			else
+			l->rules = rules;
+		}
+		struct lint_rule *r = &l->rules[l->count];
+		memset( r, 0, sizeof (struct lint_rule) );
+		r->line = line_number;
+		char *end = NULL;
+
+		if ( strcmp( check, "max-length" ) == 0 || strcmp( check, "min-length" ) == 0 )
+		{
+			r->check = check[1] == 'a' ? LINT_MAX_LENGTH : LINT_MIN_LENGTH;
+			r->length = strtoul( arg, &end, 10 );
+			if ( !isdigit( (unsigned char) *arg ) || *end )
+			{
+				fprintf( stderr, "lint_load: %s: Line %d: %s needs a length\n", filename, line_number, check );
+				ret = 1;
+			}
+		}
+		else if ( strcmp( check, "match" ) == 0 || strcmp( check, "no-match" ) == 0 )
+		{
+			r->check = check[0] == 'm' ? LINT_MATCH : LINT_NO_MATCH;
+			int sts = regcomp( &r->regex, arg, REG_EXTENDED | REG_NOSUB );
+			if ( sts != 0 )
+			{
+				char message[256];
+				regerror( sts, &r->regex, message, sizeof message );
+				fprintf( stderr, "lint_load: %s: Line %d: Bad regular expression: %s\n",
+						 filename, line_number, message );
+				r->check = LINT_UNIQUE; // Nothing to free
+				ret = 1;
+			}
+		}
+		else if ( strcmp( check, "forbid" ) == 0 )
+		{
+			r->check = LINT_FORBID;
+			if ( *arg == 0 || lint_forbid( arg, r->forbid ) != 0 )
+			{
+				fprintf( stderr, "lint_load: %s: Line %d: forbid needs characters\n", filename, line_number );
+				ret = 1;
+			}
+		}
+		else if ( strcmp( check, "unique" ) == 0 )
+		{
+			r->check = LINT_UNIQUE;
+			if ( *arg )
 			{
-				tmpbuf[0] = src[i];
-				tmpbuf[1] = '\0';
+				fprintf( stderr, "lint_load: %s: Line %d: unique takes no argument\n", filename, line_number );
+				ret = 1;
 			}
 		}
 		else
-			sprintf( tmpbuf, "\\x%02.2X", (unsigned int) ( src[i] & 0xFF ) );
-
-		if ( j + strlen( tmpbuf ) >= max )
+		{
+			fprintf( stderr, "lint_load: %s: Line %d: Unknown check \"%s\"\n", filename, line_number, check );
+			ret = 1;
 			break;
-		strcpy( dest+j, tmpbuf );
-		j += strlen( tmpbuf );
+		}
+		l->count++;
+		if ( ret == 0 && matcher_add( l->matcher, pattern, pattern_len, l->count - 1 ) != 0 )
+		{
+			fprintf( stderr, "lint_load: Out of memory\n" );
+			ret = 1;
+		}
+	}
+	free( line );
+	fclose( f );
+	if ( ret == 0 && matcher_compile( l->matcher ) != 0 )
+	{
+		fprintf( stderr, "lint_load: Out of memory\n" );
+		ret = 1;
 	}
+	return ret;
+}
 
-	return i;
+// A name seen by a unique rule, in lint_buffer()'s hash table.
+struct lint_name
+{
+	const char *name;
+	unsigned int name_len;
+	unsigned int record;
+};
+
+// The rules that matched the name being checked, each once, in order.
+struct lint_found
+{
+	unsigned int *seen;		// Record number + 1 each rule last matched on
+	unsigned int record;
+	int *rules;
+	int count;
+};
+
+static void lint_found( int id, void *arg )
+{
+	struct lint_found *found = arg;
+	if ( found->seen[id] == found->record + 1 )
+		return;
+	found->seen[id] = found->record + 1;
+	int i;
+	for ( i = found->count; i > 0 && found->rules[i-1] > id; i-- )
+		found->rules[i] = found->rules[i-1];
+	found->rules[i] = id;
+	found->count++;
 }
 
-int dump_file( int escape_mode, int file_format, const char *filename )
+// Checks the entries of the backup or flash image in buffer against the
+// rules, writing a line to out for every rule an entry breaks. Each name
+// is run through the matcher once to find the rules that apply to it.
+// Returns 0 if there were none and the backup was sound, 1 otherwise.
+static int lint_buffer( const struct lint_rules *l, int file_format, const char *name,
+						const unsigned char *buffer, size_t size, struct arena *arena, FILE *out )
 {
-	if ( !filename || ( strlen( filename ) == 0 ) )
-	{
-		fprintf( stderr, "dump_file: No filename given\n" );
+	if ( check_buffer( file_format, name, buffer, size, out, 1 ) != 0 )
 		return 1;
+
+	unsigned int record_count, found_count;
+	size_t pos = ( file_format == FMT_DEFAULTS ) ? 4 : 8, end = 0;
+	if ( is_flash( buffer, size ) )
+	{
+		char problem[128];
+		flash_header( buffer, size, &end, problem, sizeof problem );
+		record_count = walk_flash( buffer, end, &pos, NULL );
 	}
-	
-	FILE *f = fopen( filename, "rb" );
-	if ( !f )
+	else
+		record_count = read_record_count( file_format, buffer );
+
+	// Room for the records, the rules found for one, and a hash table for
+	// the unique rules that's never more than half full.
+	size_t table_size = 16;
+	while ( table_size < record_count * 2 )
+		table_size *= 2;
+	struct nvram_record *records = arena_alloc( arena, ( record_count + 1 ) * sizeof (struct nvram_record) );
+	struct lint_found found = { arena_alloc( arena, ( l->count + 1 ) * sizeof (unsigned int) ), 0,
+								arena_alloc( arena, ( l->count + 1 ) * sizeof (int) ), 0 };
+	struct lint_name *table = arena_alloc( arena, table_size * sizeof (struct lint_name) );
+	if ( !records || !found.seen || !found.rules || !table )
 	{
-		int code = errno;
-		char *errstr = strerror( code );
-		fprintf( stderr, "dump_file: Error opening %s: %s\n", filename, errstr );
+		fprintf( out, "%s: FAILED: Out of memory\n", name );
 		return 1;
 	}
+	memset( found.seen, 0, l->count * sizeof (unsigned int) );
+	memset( table, 0, table_size * sizeof (struct lint_name) );
+	if ( is_flash( buffer, size ) )
+		found_count = walk_flash( buffer, end, &pos, records );
+	else
+	{
+		int err;
+		found_count = walk_records( file_format, name, buffer, size, &pos, 0, record_count, records, &err );
+	}
 
-	static unsigned char buffer[65536]; // Static buffer for reading from nvram backup file
-	size_t read_bytes, read_size, len_size, i;
+	// Room to copy any one value for regexec(). Values in a flash image
+	// aren't limited to 64K like the ones in a backup are.
+	unsigned int record;
+	size_t value_max = 0;
+	for ( record = 0; record < found_count; record++ )
+		if ( records[record].value_len > value_max )
+			value_max = records[record].value_len;
+	char *value = arena_alloc( arena, value_max + 1 );
+	if ( !value )
+	{
+		fprintf( out, "%s: FAILED: Out of memory\n", name );
+		return 1;
+	}
 
-	if ( file_format == FMT_DEFAULTS )
+	int ret = 0, i;
+	for ( record = 0; record < found_count; record++ )
 	{
-		read_bytes = fread( buffer, sizeof (char), 4, f );
-		if ( read_bytes != 4 )
+		const struct nvram_record *r = &records[record];
+		size_t name_len = strnlen( r->name, r->name_len );
+		size_t value_len = strnlen( r->value, r->value_len );
+		if ( ( name_len == 0 ) && ( value_len == 0 ) )
+			continue;
+
+		found.record = record;
+		found.count = 0;
+		matcher_run( l->matcher, r->name, name_len, lint_found, &found );
+		for ( i = 0; i < found.count; i++ )
 		{
-			fprintf( stderr, "dump_file: File %s: Error reading header and record count\n", filename );
-			fclose( f );
-			return 1;
+			const struct lint_rule *rule = &l->rules[found.rules[i]];
+			char message[128];
+			message[0] = 0;
+			switch ( rule->check )
+			{
+			case LINT_MAX_LENGTH:
+				if ( value_len > rule->length )
+					snprintf( message, sizeof message, "Value is %zu bytes, more than %lu", value_len, rule->length );
+				break;
+
+			case LINT_MIN_LENGTH:
+				if ( value_len < rule->length )
+					snprintf( message, sizeof message, "Value is %zu bytes, less than %lu", value_len, rule->length );
+				break;
+
+			case LINT_MATCH:
+			case LINT_NO_MATCH:
+				memcpy( value, r->value, value_len );
+				value[value_len] = 0;
+				if ( ( regexec( &rule->regex, value, 0, NULL, 0 ) == 0 ) != ( rule->check == LINT_MATCH ) )
+					snprintf( message, sizeof message, rule->check == LINT_MATCH ?
+							  "Value doesn't match" : "Value matches" );
+				break;
+
+			case LINT_FORBID:
+			{
+				size_t j;
+				for ( j = 0; j < value_len && !rule->forbid[(unsigned char) r->value[j]]; j++ )
+					;
+				if ( j < value_len )
+				{
+					char esc[5];
+					escape_string( ESC_FULL, r->value + j, 1, esc, sizeof esc );
+					snprintf( message, sizeof message, "Value contains forbidden %s at byte %zu", esc, j );
+				}
+				break;
+			}
+
+			case LINT_UNIQUE:
+			{
+				size_t h = crc32c( 0, r->name, name_len ) & ( table_size - 1 );
+				while ( table[h].name && ( table[h].name_len != name_len ||
+										   memcmp( table[h].name, r->name, name_len ) != 0 ) )
+					h = ( h + 1 ) & ( table_size - 1 );
+				if ( !table[h].name )
+				{
+					table[h].name = r->name;
+					table[h].name_len = name_len;
+					table[h].record = record;
+				}
+				else if ( table[h].record != record )
+					snprintf( message, sizeof message, "Name already used by record %u", table[h].record + 1 );
+				break;
+			}
+			}
+			if ( message[0] )
+			{
+				char esc_name[255*4 + 1];
+				escape_string( ESC_FULL, r->name, name_len, esc_name, sizeof esc_name );
+				fprintf( out, "%s: Record %u: Name %s: %s (%s line %d)\n",
+						 name, record+1, esc_name, message, l->filename, rule->line );
+				ret = 1;
+			}
 		}
 	}
-	else
+	return ret;
+}
+
+// Checks one file, or each backup in it if it's a tar archive, writing the
+// results to out. With lint the entries are checked against its rules as
+// well. Returns 0 if everything was sound, 1 otherwise.
+static int check_file( int file_format, const struct lint_rules *lint, const char *filename,
+					   struct arena *arena, FILE *out )
+{
+	FILE *f = compress_open( filename );
+	if ( !f )
 	{
-		read_bytes = fread( buffer, sizeof (char), 8, f );
-		if ( read_bytes != 8 || memcmp( buffer, "DD-WRT", 6 ) )
+		fprintf( out, "%s: FAILED: %s\n", filename, strerror( errno ) );
+		return 1;
+	}
+
+	unsigned char block[TAR_BLOCK];
+	size_t n = fread( block, sizeof (char), TAR_BLOCK, f );
+	if ( !tar_is_header( block, n ) )
+	{
+		f = compress_unread( f, filename, block, n );
+		size_t size = 0;
+		unsigned char *buffer = f ? (unsigned char *) arena_read_file( arena, f, &size ) : NULL;
+		if ( f && compress_close( f ) != 0 )
+			buffer = NULL;
+		if ( !buffer )
 		{
-			fprintf( stderr, "dump_file: File %s: Error reading header and record count\n", filename );
-			fclose( f );
+			fprintf( out, "%s: FAILED: Error reading file\n", filename );
 			return 1;
 		}
+		if ( lint )
+			return lint_buffer( lint, file_format, filename, buffer, size, arena, out );
+		return check_buffer( file_format, filename, buffer, size, out, 0 );
 	}
 
-	unsigned int record_count = 0;
-	unsigned int name_len, value_len;
-	static char name[257], value[65537];
-	unsigned int record = 0;
-
-	if ( file_format == FMT_DEFAULTS )
-		record_count = buffer[1] * 256 + buffer[0]; // TODO byte ordering
-	else
-		record_count = buffer[7] * 256 + buffer[6]; // TODO byte ordering
-
-	while ( record < record_count )
+	struct tar_reader t;
+	int sts, ret = 0;
+	tar_open( &t, f, block );
+	while ( ( sts = tar_next( &t ) ) > 0 )
 	{
-		record++;
-
-		// Read the 1-byte length and the variable name.
-		read_bytes = fread( buffer, sizeof (char), 1, f );
-		if ( read_bytes != 1 )
+		arena_reset( arena );
+		size_t label_len = strlen( filename ) + strlen( t.name ) + 2;
+		char *label = arena_alloc( arena, label_len );
+		if ( label )
+			snprintf( label, label_len, "%s:%s", filename, t.name );
+		if ( label && t.size > TAR_MEMBER_MAX )
 		{
-			fprintf( stderr, "dump_file: File %s: Error reading name length from record %u\n",
-					 filename, record );
-			fclose( f );
-			return 1;
+			fprintf( out, "%s: FAILED: Too big at %llu bytes\n", label, t.size );
+			ret = 1;
+			continue;
 		}
-		name_len = buffer[0];
-		read_bytes = fread( buffer, sizeof (char), name_len, f );
-		if ( read_bytes != name_len )
+		char *buffer = label ? arena_alloc( arena, t.size + 1 ) : NULL;
+		if ( !buffer )
 		{
-			fprintf( stderr, "dump_file: File %s: Error reading name from record %u\n",
-					 filename, record );
-			fclose( f );
-			return 1;
+			fprintf( out, "%s: FAILED: Out of memory\n", filename );
+			ret = 1;
+			break;
 		}
-		memcpy( name, buffer, name_len );
-		name[name_len] = 0;
-
-		// Read the length and value.
-		len_size = ( file_format == FMT_DEFAULTS ) ? 1 : 2;
-		read_bytes = fread( buffer, sizeof (char), len_size, f );
-		if ( read_bytes != len_size )
+		size_t size = t.size;
+		if ( tar_read( &t, buffer, size ) != size )
 		{
-			fprintf( stderr, "dump_file: File %s: Error reading value length from record %u\n",
-					 filename, record );
-			fclose( f );
-			return 1;
+			fprintf( out, "%s: FAILED: Error reading file\n", label );
+			ret = 1;
+			break;
 		}
-		value_len = 0;
-		for ( i = 1; i <= len_size; i++ ) // Loop works backwards, accounts for 0-based index
-			value_len = ( value_len * 256 ) + buffer[len_size-i]; // TODO byte ordering
-		if ( value_len > 0 )
+		buffer[size] = 0;
+		if ( compress_detect( (unsigned char *) buffer, size ) != COMPRESS_NONE )
+			buffer = compress_decode( arena, label, buffer, size, &size );
+		if ( !buffer )
 		{
-			read_bytes = fread( buffer, sizeof (char), value_len, f );
-			if ( read_bytes != value_len )
-			{
-				fprintf( stderr, "dump_file: File %s: Error reading value from record %u\n",
-						 filename, record );
-				fclose( f );
-				return 1;
-			}
-			memcpy( value, buffer, value_len );
-			value[value_len] = 0;
+			fprintf( out, "%s: FAILED: Error reading file\n", label );
+			ret = 1;
 		}
-		else
+		else if ( lint && lint_buffer( lint, file_format, label, (unsigned char *) buffer, size, arena, out ) != 0 )
+			ret = 1;
+		else if ( !lint && check_buffer( file_format, label, (unsigned char *) buffer, size, out, 0 ) != 0 )
+			ret = 1;
+	}
+	if ( sts < 0 )
+	{
+		fprintf( out, "%s: FAILED: Corrupt or truncated tar archive\n", filename );
+		ret = 1;
+	}
+	if ( compress_close( f ) != 0 )
+		ret = 1;
+	return ret;
+}
+
+// The files being checked, shared by the threads checking them. Each thread
+// takes the next file not yet claimed and keeps its results for the main
+// thread to print in command-line order.
+struct check_job
+{
+	int file_format;
+	const struct lint_rules *lint;	// Rules for --lint, NULL for --check
+	char **filenames;
+	char **results;
+	int *failed;
+	int count;
+	int next;
+};
+
+static void *check_worker( void *arg )
+{
+	struct check_job *job = arg;
+	struct arena arena;
+	int i;
+	arena_init( &arena, ARENA_BLOCK_SIZE );
+	while ( ( i = __atomic_fetch_add( &job->next, 1, __ATOMIC_RELAXED ) ) < job->count )
+	{
+		size_t len;
+		double t = stats_now();
+		FILE *out = open_memstream( &job->results[i], &len );
+		if ( !out )
 		{
-			value[0] = 0;
+			job->failed[i] = 1;
+			continue;
 		}
+		arena_reset( &arena );
+		job->failed[i] = check_file( job->file_format, job->lint, job->filenames[i], &arena, out );
+		fclose( out );
+		trace_span( job->lint ? "lint" : "check", "file", t, stats_now(), job->filenames[i] );
+	}
+	arena_free( &arena );
+	return NULL;
+}
 
-		// Skip completely empty records
-		if ( ( strlen( name ) == 0 ) && ( strlen( value ) == 0 ) )
-			continue;
+// Checks the structure of count files for --check, threads of them at a
+// time, and writes a line for each backup saying whether it's sound. For
+// --lint, lint has the rules to check the entries against, and there's
+// only a line for each problem found. Returns 0 if there were none, 1
+// otherwise.
+int check_files( int file_format, const struct lint_rules *lint, char **filenames, int count, int threads )
+{
+	struct check_job job = { file_format, lint, filenames, NULL, NULL, count, 0 };
+	job.results = calloc( count, sizeof (char *) );
+	job.failed = calloc( count, sizeof (int) );
+	if ( !job.results || !job.failed )
+	{
+		fprintf( stderr, "check_files: Out of memory\n" );
+		free( job.results );
+		free( job.failed );
+		return 1;
+	}
 
-		static char esc_name[513], esc_value[65536*2 + 1];
-		int copied;
+	if ( threads > count )
+		threads = count;
+	if ( threads > 1 )
+		run_threads( threads, check_worker, &job );
+	else
+		check_worker( &job );
 
-		esc_name[0] = 0;
-		esc_value[0] = 0;
-		copied = escape_string( ESC_FULL, name, esc_name, 513 );
-		if ( copied < strlen( name ) )
-			fprintf( stderr, "dump_file: File %s: Record %u: cannot copy entire name %s\n",
-					 filename, record, name );
-		else if ( strlen( name ) < strlen( esc_name ) )
-			fprintf( stderr, "dump_file: File %s: Record %u: Name %s: contains non-printable characters\n",
-					 filename, record, esc_name );
-		copied = escape_string( escape_mode, value, esc_value, 65536*2 + 1 );
-		if ( copied < strlen( value ) )
-			fprintf( stderr, "dump_file: File %s: Record %u: Name %s: cannot copy entire value\n",
-					 filename, record, esc_name );
-		fprintf( stdout, "%s=%s\n", esc_name, esc_value );
-		fflush( stdout );
+	int i, ret = 0;
+	for ( i = 0; i < count; i++ )
+	{
+		if ( job.results[i] )
+			fputs( job.results[i], stdout );
+		else
+			fprintf( stderr, "check_files: File %s: Out of memory\n", filenames[i] );
+		free( job.results[i] );
+		if ( job.failed[i] )
+			ret = 1;
 	}
-
-	fclose( f );
-	return 0;
+	free( job.results );
+	free( job.failed );
+	return ret;
 }
 
 int main( int argc, char **argv )
 {
 	int escape = ESC_FULL;
 	int file_format = FMT_NVRAM;
+	int stream = DEFAULT_STREAM;
+	int uring_depth = 0;
+	int pipeline = 0;
+	int threads = 1;
+	int compress = COMPRESS_NONE;
+	int output = OUT_TEXT;
+	int sort = SORT_NONE;
+	int fingerprint = 0;
+	int check = 0;
+	const char *lint = NULL;
+	int redact = 0;
+	const char *redact_file = NULL;
 	
 	// Check our arguments for options, and for at least one filename after
 	// the options.
+	static const struct option long_options[] =
+	{
+		{ "stats", no_argument, NULL, OPT_STATS },
+		{ "trace", required_argument, NULL, OPT_TRACE },
+		{ "stream", no_argument, NULL, OPT_STREAM },
+		{ "uring", optional_argument, NULL, OPT_URING },
+		{ "pipeline", no_argument, NULL, OPT_PIPELINE },
+		{ "compress", required_argument, NULL, OPT_COMPRESS },
+		{ "json", optional_argument, NULL, OPT_JSON },
+		{ "json-bytes", no_argument, NULL, OPT_JSON_BYTES },
+		{ "sort", optional_argument, NULL, OPT_SORT },
+		{ "fingerprint", optional_argument, NULL, OPT_FINGERPRINT },
+		{ "check", no_argument, NULL, OPT_CHECK },
+		{ "lint", required_argument, NULL, OPT_LINT },
+		{ "redact", optional_argument, NULL, OPT_REDACT },
+		{ NULL, 0, NULL, 0 }
+	};
 	int opt;
-	while ( ( opt = getopt( argc, argv, "hd" ) ) != -1 )
+	int utf8 = 0;
+	int bytes = 0;
+	while ( ( opt = getopt_long( argc, argv, "hdj:0u", long_options, NULL ) ) != -1 )
 	{
-		switch ( (char) opt )
+		switch ( opt )
 		{
+		case 'u':
+			utf8 = ESC_UTF8;
+			break;
+
+		case '0':
+			output = OUT_RAW;
+			break;
+
 		case 'h':
 			escape = ESC_HUMAN;
 			break;
@@ -256,31 +2834,198 @@ int main( int argc, char **argv )
 			file_format = FMT_DEFAULTS;
 			break;
 
+		case 'j':
+			threads = atoi( optarg );
+			if ( threads < 1 || threads > MAX_THREADS )
+			{
+				fprintf( stderr, "Thread count for -j must be from 1 to %d\n", MAX_THREADS );
+				return 1;
+			}
+			break;
+
+		case OPT_STATS:
+			stats_enabled = 1;
+			break;
+
+		case OPT_STREAM:
+			stream = 1;
+			break;
+
+		case OPT_PIPELINE:
+			pipeline = 1;
+			break;
+
+		case OPT_URING:
+			uring_depth = optarg ? atoi( optarg ) : DEFAULT_URING_DEPTH;
+			if ( uring_depth < 1 )
+			{
+				fprintf( stderr, "Queue depth for --uring must be at least 1\n" );
+				return 1;
+			}
+			break;
+
+		case OPT_COMPRESS:
+			compress = compress_format( optarg );
+			if ( compress < 0 )
+			{
+				fprintf( stderr, "Compression format %s is not supported\n", optarg );
+				return 1;
+			}
+			break;
+
+		case OPT_JSON:
+			if ( !optarg || strcmp( optarg, "record" ) == 0 )
+				output = OUT_JSON;
+			else if ( strcmp( optarg, "file" ) == 0 )
+				output = OUT_JSON_FILE;
+			else
+			{
+				fprintf( stderr, "JSON output must be one object per record or per file\n" );
+				return 1;
+			}
+			break;
+
+		case OPT_JSON_BYTES:
+			bytes = ESC_BYTES;
+			break;
+
+		case OPT_SORT:
+			if ( !optarg )
+				sort = SORT_NAME;
+			else if ( strcmp( optarg, "unique" ) == 0 )
+				sort = SORT_UNIQUE;
+			else
+			{
+				fprintf( stderr, "Sort order must be by name or by name with repeats removed\n" );
+				return 1;
+			}
+			break;
+
+		case OPT_FINGERPRINT:
+			if ( !optarg )
+				fingerprint = OUT_FINGERPRINT;
+			else if ( strcmp( optarg, "keys" ) == 0 )
+				fingerprint = OUT_FINGERPRINT_KEYS;
+			else
+			{
+				fprintf( stderr, "--fingerprint takes no argument or \"keys\"\n" );
+				return 1;
+			}
+			break;
+
+		case OPT_CHECK:
+			check = 1;
+			break;
+
+		case OPT_LINT:
+			lint = optarg;
+			break;
+
+		case OPT_REDACT:
+			redact = 1;
+			redact_file = optarg;
+			break;
+
+		case OPT_TRACE:
+			// Every exit after this point, including the error returns,
+			// has to finish the trace or it's left as unterminated JSON.
+			if ( trace_open( optarg ) != 0 )
+				return 1;
+			atexit( trace_close );
+			break;
+
 		default:
-			fprintf( stderr, "Usage: %s [-h] [-d] <filename>...\n", argv[0] );
+			fprintf( stderr, "Usage: %s [-h] [-u] [-d] [-0] [-j <threads>] [--stats] [--trace=<trace_file>] [--stream] [--uring[=<depth>]] [--pipeline] [--compress=<format>] [--json[=record|file]] [--json-bytes] [--sort[=unique]] [--fingerprint[=keys]] [--check] [--lint=<rules_file>] [--redact[=<patterns_file>]] <filename>...\n", argv[0] );
 			return 1;
 		}
 	}
 	if ( optind >= argc )
 	{
 		fprintf( stderr, "Expected at least one file\n" );
-		fprintf( stderr, "Usage: %s [-h] [-d] <filename>...\n", argv[0] );
+		fprintf( stderr, "Usage: %s [-h] [-u] [-d] [-0] [-j <threads>] [--stats] [--trace=<trace_file>] [--stream] [--uring[=<depth>]] [--pipeline] [--compress=<format>] [--json[=record|file]] [--json-bytes] [--sort[=unique]] [--fingerprint[=keys]] [--check] [--lint=<rules_file>] [--redact[=<patterns_file>]] <filename>...\n", argv[0] );
+		return 1;
+	}
+
+	// Checking only looks at each file's structure, so none of the rest
+	// applies to it. Linting checks the structure as well, so it covers
+	// --check when both are given.
+	if ( lint )
+	{
+		struct lint_rules rules;
+		int ret = lint_load( &rules, lint );
+		if ( ret == 0 )
+			ret = check_files( file_format, &rules, argv + optind, argc - optind, threads );
+		lint_free( &rules );
+		return ret;
+	}
+	if ( check )
+	{
+		return check_files( file_format, NULL, argv + optind, argc - optind, threads );
+	}
+
+	// The names to hide values of are compiled once, up front.
+	struct matcher *redact_matcher = NULL;
+	if ( redact && ( redact_matcher = redact_load( redact_file ) ) == NULL )
+		return 1;
+
+	if ( compress != COMPRESS_NONE && compress_stdout( compress ) != 0 )
+	{
+		fprintf( stderr, "main: Cannot compress output: %s\n", strerror( errno ) );
+		matcher_free( redact_matcher );
 		return 1;
 	}
 
 	// Dump out each filename given. If any file fails, we fail.
+	struct dump_context ctx;
 	int sts, i;
 	int ret = 0;
-	for ( i = optind; i < argc; i++ )
+	dump_init( &ctx, escape | utf8 | bytes, file_format );
+	ctx.output = output;
+	ctx.sort = sort;
+	ctx.threads = threads;
+	ctx.redact = redact_matcher;
+	if ( fingerprint )
+	{
+		// A fingerprint takes the place of the dump.
+		ctx.output = fingerprint;
+		stats_escape_name = "hash";
+	}
+	// Sorting and fingerprints need all of a file's records at once, so
+	// they can't stream.
+	if ( sort == SORT_NONE && !fingerprint )
+	{
+		ctx.stream = stream;
+		ctx.pipeline = pipeline;
+	}
+	else
+	{
+		ctx.stream = 0;
+		ctx.pipeline = 0;
+	}
+	if ( uring_depth > 0 )
+	{
+		// The batch reader hands over whole files, so it can't stream.
+		ctx.stream = 0;
+		ctx.pipeline = 0;
+		ret = dump_batch( &ctx, argv + optind, argc - optind, uring_depth );
+	}
+	else for ( i = optind; i < argc; i++ )
 	{
 		if ( argv[i] )
 		{
-			sts = dump_file( escape, file_format, argv[i] );
+			sts = dump_file( &ctx, argv[i] );
 			// Remember our first failure, but keep on going with the rest of the
 			// files so we catch all errors in one pass.
 			if ( sts && !ret )
 				ret = sts;
 		}
 	}
+	if ( compress != COMPRESS_NONE && compress_close( stdout ) != 0 )
+		ret = 1;
+	if ( stats_enabled )
+		stats_report( stderr, NULL, &ctx.total );
+	dump_cleanup( &ctx );
+	matcher_free( redact_matcher );
+	trace_close();
 	return ret;
 }
@@ -0,0 +1,511 @@
+// nvram_io.c
+// Copyright 2015, Todd Knarr <tknarr@silverglass.org>
+// Licensed under the terms of the GPL v3 or any later version.
+// See LICENSE.md for complete license terms.
+
+//	  This program is free software: you can redistribute it and/or modify
+//	  it under the terms of the GNU General Public License as published by
+//	  the Free Software Foundation, either version 3 of the License, or
+//	  (at your option) any later version.
+
+//	  This program is distributed in the hope that it will be useful,
+//	  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+//	  GNU General Public License for more details.
+
+//	  You should have received a copy of the GNU General Public License
+//	  along with this program.	If not, see <http://www.gnu.org/licenses/>.
+
+// Batch reader. Each file in flight owns a slot, file i using slot
+// i % depth, and steps through open, read (repeated until end of file) and
+// close. With io_uring each step is one submission, so all the slots'
+// operations overlap; the ring is driven with raw system calls so there's
+// no dependency on liburing.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "nvram_io.h"
+
+// Slot states
+#define SLOT_IDLE		0
+#define SLOT_OPENING	1
+#define SLOT_READING	2
+#define SLOT_CLOSING	3
+#define SLOT_DONE		4
+
+// Initial buffer size for each slot, grown as needed and kept for the
+// next file that uses the slot.
+#define SLOT_BUFFER_SIZE	( 64*1024 )
+
+struct batch_slot
+{
+	int state;
+	int file;		// Index into the filenames
+	int fd;
+	int error;		// errno value, or 0
+	int stage;		// BATCH_OPEN or BATCH_READ when error is set
+	char *buffer;
+	size_t allocated;
+	size_t used;
+};
+
+#if defined( __linux__ ) && defined( __NR_io_uring_setup )
+#define HAVE_URING 1
+
+struct uring
+{
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	unsigned to_submit;		// Queued but not yet passed to the kernel
+};
+#endif
+
+struct batch_reader
+{
+	char **filenames;
+	int count;
+	int depth;
+	int next_start;		// Next file to start reading
+	int next_return;	// Next file to hand back
+	int returned;		// Slot handed back by the last batch_next(), or -1
+	struct batch_slot *slots;
+	int uring;			// Non-zero if ring is in use
+#ifdef HAVE_URING
+	struct uring ring;
+#endif
+};
+
+// Makes sure the slot's buffer has room for at least one more read plus
+// the terminating NUL. Returns 0 on success or an errno value.
+static int slot_reserve( struct batch_slot *s )
+{
+	if ( s->allocated - s->used >= 4096 )
+		return 0;
+	size_t allocated = s->allocated ? s->allocated * 2 : SLOT_BUFFER_SIZE;
+	char *p = realloc( s->buffer, allocated );
+	if ( !p )
+		return ENOMEM;
+	s->buffer = p;
+	s->allocated = allocated;
+	return 0;
+}
+
+// Reads a file into its slot with ordinary blocking calls.
+static void slot_read_sync( struct batch_slot *s, const char *filename )
+{
+	ssize_t n;
+
+	s->used = 0;
+	s->error = 0;
+	// "-" is the standard input, read from a copy of the descriptor so
+	// closing it below leaves the original alone.
+	s->fd = strcmp( filename, "-" ) == 0 ? dup( STDIN_FILENO ) : open( filename, O_RDONLY );
+	if ( s->fd < 0 )
+	{
+		s->error = errno;
+		s->stage = BATCH_OPEN;
+		s->state = SLOT_DONE;
+		return;
+	}
+	for ( ;; )
+	{
+		s->error = slot_reserve( s );
+		if ( s->error )
+			break;
+		n = read( s->fd, s->buffer + s->used, s->allocated - s->used - 1 );
+		if ( n < 0 && errno == EINTR )
+			continue;
+		if ( n < 0 )
+			s->error = errno;
+		if ( n <= 0 )
+			break;
+		s->used += n;
+	}
+	if ( s->error )
+		s->stage = BATCH_READ;
+	else
+		s->buffer[s->used] = 0;
+	close( s->fd );
+	s->fd = -1;
+	s->state = SLOT_DONE;
+}
+
+#ifdef HAVE_URING
+
+static int uring_setup( struct uring *u, unsigned entries )
+{
+	struct io_uring_params p;
+	memset( &p, 0, sizeof (p) );
+	memset( u, 0, sizeof (struct uring) );
+
+	u->fd = syscall( __NR_io_uring_setup, entries, &p );
+	if ( u->fd < 0 )
+		return 1;
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if ( p.features & IORING_FEAT_SINGLE_MMAP )
+	{
+		if ( u->cq_ring_size > u->sq_ring_size )
+			u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = u->sq_ring_size;
+	}
+	u->sq_ring = mmap( NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					   u->fd, IORING_OFF_SQ_RING );
+	if ( u->sq_ring == MAP_FAILED )
+	{
+		close( u->fd );
+		return 1;
+	}
+	if ( p.features & IORING_FEAT_SINGLE_MMAP )
+		u->cq_ring = u->sq_ring;
+	else
+	{
+		u->cq_ring = mmap( NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+						   u->fd, IORING_OFF_CQ_RING );
+		if ( u->cq_ring == MAP_FAILED )
+		{
+			munmap( u->sq_ring, u->sq_ring_size );
+			close( u->fd );
+			return 1;
+		}
+	}
+	u->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+	u->sqes = mmap( NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					u->fd, IORING_OFF_SQES );
+	if ( u->sqes == MAP_FAILED )
+	{
+		if ( u->cq_ring != u->sq_ring )
+			munmap( u->cq_ring, u->cq_ring_size );
+		munmap( u->sq_ring, u->sq_ring_size );
+		close( u->fd );
+		return 1;
+	}
+
+	char *sq = u->sq_ring, *cq = u->cq_ring;
+	u->sq_head = (unsigned *) ( sq + p.sq_off.head );
+	u->sq_tail = (unsigned *) ( sq + p.sq_off.tail );
+	u->sq_mask = (unsigned *) ( sq + p.sq_off.ring_mask );
+	u->sq_array = (unsigned *) ( sq + p.sq_off.array );
+	u->cq_head = (unsigned *) ( cq + p.cq_off.head );
+	u->cq_tail = (unsigned *) ( cq + p.cq_off.tail );
+	u->cq_mask = (unsigned *) ( cq + p.cq_off.ring_mask );
+	u->cqes = (struct io_uring_cqe *) ( cq + p.cq_off.cqes );
+	return 0;
+}
+
+static void uring_teardown( struct uring *u )
+{
+	munmap( u->sqes, u->sqes_size );
+	if ( u->cq_ring != u->sq_ring )
+		munmap( u->cq_ring, u->cq_ring_size );
+	munmap( u->sq_ring, u->sq_ring_size );
+	close( u->fd );
+}
+
+// Queues one operation. There's never more than one operation per slot,
+// and the ring has at least as many entries as there are slots, so the
+// submission queue can't overflow.
+static struct io_uring_sqe *uring_queue( struct uring *u, int opcode, int slot )
+{
+	unsigned tail = *u->sq_tail;
+	unsigned index = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[index];
+
+	memset( sqe, 0, sizeof (struct io_uring_sqe) );
+	sqe->opcode = opcode;
+	sqe->user_data = slot;
+	u->sq_array[index] = index;
+	__atomic_store_n( u->sq_tail, tail + 1, __ATOMIC_RELEASE );
+	u->to_submit++;
+	return sqe;
+}
+
+// Submits everything queued and waits for at least one completion.
+// Returns 0 on success or an errno value.
+static int uring_wait( struct uring *u )
+{
+	for ( ;; )
+	{
+		int n = syscall( __NR_io_uring_enter, u->fd, u->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0 );
+		if ( n >= 0 )
+		{
+			u->to_submit -= n;
+			return 0;
+		}
+		if ( errno != EINTR )
+			return errno;
+	}
+}
+
+// Hands everything queued to the kernel without waiting, so the operations
+// are in flight while the caller works on the file it already has. A
+// failure here is left for the next uring_wait() to run into.
+static void uring_submit( struct uring *u )
+{
+	while ( u->to_submit > 0 )
+	{
+		int n = syscall( __NR_io_uring_enter, u->fd, u->to_submit, 0, 0, NULL, 0 );
+		if ( n > 0 )
+			u->to_submit -= n;
+		else if ( n == 0 || errno != EINTR )
+			break;
+	}
+}
+
+static void uring_queue_read( struct batch_reader *r, int slot )
+{
+	struct batch_slot *s = &r->slots[slot];
+	struct io_uring_sqe *sqe = uring_queue( &r->ring, IORING_OP_READ, slot );
+	sqe->fd = s->fd;
+	sqe->addr = (unsigned long) ( s->buffer + s->used );
+	sqe->len = s->allocated - s->used - 1;
+	sqe->off = s->used;
+}
+
+static void uring_queue_close( struct batch_reader *r, int slot )
+{
+	struct io_uring_sqe *sqe = uring_queue( &r->ring, IORING_OP_CLOSE, slot );
+	sqe->fd = r->slots[slot].fd;
+}
+
+// Moves a slot on to its next step when its current operation completes.
+static void uring_complete( struct batch_reader *r, int slot, int res )
+{
+	struct batch_slot *s = &r->slots[slot];
+
+	switch ( s->state )
+	{
+	case SLOT_OPENING:
+		if ( res == -EINVAL || res == -EOPNOTSUPP )
+		{
+			// Kernel too old for this operation, do it the slow way.
+			slot_read_sync( s, r->filenames[s->file] );
+			break;
+		}
+		if ( res < 0 )
+		{
+			s->error = -res;
+			s->stage = BATCH_OPEN;
+			s->state = SLOT_DONE;
+			break;
+		}
+		s->fd = res;
+		s->state = SLOT_READING;
+		s->error = slot_reserve( s );
+		if ( s->error )
+		{
+			s->stage = BATCH_READ;
+			s->state = SLOT_CLOSING;
+			uring_queue_close( r, slot );
+			break;
+		}
+		uring_queue_read( r, slot );
+		break;
+
+	case SLOT_READING:
+		if ( res > 0 )
+		{
+			s->used += res;
+			s->error = slot_reserve( s );
+			if ( !s->error )
+			{
+				uring_queue_read( r, slot );
+				break;
+			}
+		}
+		else if ( res < 0 )
+			s->error = -res;
+		if ( s->error )
+			s->stage = BATCH_READ;
+		else
+			s->buffer[s->used] = 0;
+		s->state = SLOT_CLOSING;
+		uring_queue_close( r, slot );
+		break;
+
+	case SLOT_CLOSING:
+		s->fd = -1;
+		s->state = SLOT_DONE;
+		break;
+	}
+}
+
+// Handles every completion that's waiting.
+static void uring_reap( struct batch_reader *r )
+{
+	struct uring *u = &r->ring;
+	unsigned head = *u->cq_head;
+	while ( head != __atomic_load_n( u->cq_tail, __ATOMIC_ACQUIRE ) )
+	{
+		struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+		int slot = (int) cqe->user_data, res = cqe->res;
+		head++;
+		__atomic_store_n( u->cq_head, head, __ATOMIC_RELEASE );
+		uring_complete( r, slot, res );
+	}
+	// Start the follow-up operations the completions just queued.
+	uring_submit( u );
+}
+
+#endif // HAVE_URING
+
+// Passes whatever start_next() queued on to the kernel.
+static void submit_started( struct batch_reader *r )
+{
+#ifdef HAVE_URING
+	if ( r->uring )
+		uring_submit( &r->ring );
+#else
+	(void) r;
+#endif
+}
+
+// Starts reading the next file into its slot.
+static void start_next( struct batch_reader *r )
+{
+	if ( r->next_start >= r->count )
+		return;
+	int slot = r->next_start % r->depth;
+	struct batch_slot *s = &r->slots[slot];
+	s->file = r->next_start++;
+	s->used = 0;
+	s->error = 0;
+	s->fd = -1;
+#ifdef HAVE_URING
+	if ( r->uring && strcmp( r->filenames[s->file], "-" ) != 0 )
+	{
+		s->state = SLOT_OPENING;
+		struct io_uring_sqe *sqe = uring_queue( &r->ring, IORING_OP_OPENAT, slot );
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (unsigned long) r->filenames[s->file];
+		sqe->open_flags = O_RDONLY;
+		return;
+	}
+#endif
+	// Without io_uring, or for the standard input which can't be read at an
+	// offset, the read happens when the file is asked for.
+	s->state = SLOT_IDLE;
+}
+
+struct batch_reader *batch_open( char **filenames, int count, int depth )
+{
+	struct batch_reader *r = calloc( 1, sizeof (struct batch_reader) );
+	if ( !r )
+		return NULL;
+	if ( depth < 1 )
+		depth = 1;
+	if ( depth > count && count > 0 )
+		depth = count;
+	r->filenames = filenames;
+	r->count = count;
+	r->depth = depth;
+	r->returned = -1;
+	r->slots = calloc( depth, sizeof (struct batch_slot) );
+	if ( !r->slots )
+	{
+		free( r );
+		return NULL;
+	}
+#ifdef HAVE_URING
+	r->uring = ( uring_setup( &r->ring, depth ) == 0 );
+#endif
+	while ( r->next_start < depth && r->next_start < count )
+		start_next( r );
+	submit_started( r );
+	return r;
+}
+
+int batch_is_uring( const struct batch_reader *r )
+{
+	return r->uring;
+}
+
+int batch_next( struct batch_reader *r, const char **filename, char **data, size_t *size, int *stage )
+{
+	// The slot handed back last time is free again.
+	if ( r->returned >= 0 )
+	{
+		r->slots[r->returned].state = SLOT_IDLE;
+		r->returned = -1;
+		start_next( r );
+		submit_started( r );
+	}
+	if ( r->next_return >= r->count )
+		return -1;
+
+	int slot = r->next_return % r->depth;
+	struct batch_slot *s = &r->slots[slot];
+	*filename = r->filenames[r->next_return];
+	r->next_return++;
+	r->returned = slot;
+
+	if ( !r->uring || s->state == SLOT_IDLE )
+		slot_read_sync( s, *filename );
+#ifdef HAVE_URING
+	while ( s->state != SLOT_DONE )
+	{
+		int err = uring_wait( &r->ring );
+		if ( err )
+		{
+			// The ring itself failed; finish this file the slow way.
+			if ( s->fd >= 0 )
+				close( s->fd );
+			slot_read_sync( s, *filename );
+			break;
+		}
+		uring_reap( r );
+	}
+#endif
+
+	if ( s->error )
+	{
+		*stage = s->stage;
+		return s->error;
+	}
+	*data = s->buffer;
+	*size = s->used;
+	return 0;
+}
+
+void batch_close( struct batch_reader *r )
+{
+	int i;
+#ifdef HAVE_URING
+	if ( r->uring )
+	{
+		// Let the operations still in flight finish before their buffers
+		// and the ring go away.
+		for ( i = 0; i < r->depth; i++ )
+		{
+			while ( r->slots[i].state != SLOT_DONE && r->slots[i].state != SLOT_IDLE )
+			{
+				if ( uring_wait( &r->ring ) )
+					break;
+				uring_reap( r );
+			}
+		}
+		uring_teardown( &r->ring );
+	}
+#endif
+	for ( i = 0; i < r->depth; i++ )
+		free( r->slots[i].buffer );
+	free( r->slots );
+	free( r );
+}
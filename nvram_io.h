@@ -0,0 +1,37 @@
+// nvram_io.h
+// Copyright 2015, Todd Knarr <tknarr@silverglass.org>
+// Licensed under the terms of the GPL v3 or any later version.
+// See LICENSE.md for complete license terms.
+
+// Input backends for reading many whole files. The batch reader keeps
+// several files' open and read operations in flight at once using io_uring
+// where the kernel supports it, and falls back to plain open()/read() one
+// file at a time where it doesn't. Files are always handed back in the
+// order they were given.
+
+#ifndef NVRAM_IO_H
+#define NVRAM_IO_H
+
+#include <stddef.h>
+
+// Where a batch read failed
+#define BATCH_OPEN		0
+#define BATCH_READ		1
+
+struct batch_reader;
+
+// Starts reading count files, keeping up to depth of them in flight.
+// Returns NULL if out of memory.
+struct batch_reader *batch_open( char **filenames, int count, int depth );
+// Non-zero if the reader is using io_uring rather than the fallback.
+int batch_is_uring( const struct batch_reader *r );
+// Waits for the next file in order. On success returns 0 and points *data
+// at its contents, which stay valid until the next call; *data is followed
+// by a NUL that isn't counted in *size. Returns -1 when all files have been
+// returned, or an errno value if the file couldn't be read, with *stage
+// saying whether opening or reading failed.
+int batch_next( struct batch_reader *r, const char **filename, char **data, size_t *size, int *stage );
+// Waits for any reads still in flight to finish, then frees the reader.
+void batch_close( struct batch_reader *r );
+
+#endif // NVRAM_IO_H
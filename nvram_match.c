@@ -0,0 +1,251 @@
+// nvram_match.c
+// Copyright 2015, Todd Knarr <tknarr@silverglass.org>
+// Licensed under the terms of the GPL v3 or any later version.
+// See LICENSE.md for complete license terms.
+
+//	  This program is free software: you can redistribute it and/or modify
+//	  it under the terms of the GNU General Public License as published by
+//	  the Free Software Foundation, either version 3 of the License, or
+//	  (at your option) any later version.
+
+//	  This program is distributed in the hope that it will be useful,
+//	  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+//	  GNU General Public License for more details.
+
+//	  You should have received a copy of the GNU General Public License
+//	  along with this program.	If not, see <http://www.gnu.org/licenses/>.
+
+// The patterns go into a trie, which compiling turns into a complete state
+// machine: every state has a transition for every symbol, the failure
+// links folded in, so matching is one table lookup per byte. The anchors
+// are two extra symbols, fed in before and after the name's bytes. Each
+// state keeps the patterns ending there, and a link to the nearest state
+// down its chain of failure links that has some, for the patterns that end
+// there too.
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "nvram_match.h"
+
+#define SYM_START	256
+#define SYM_END		257
+#define SYMBOLS		258
+
+struct matcher
+{
+	int ignore_case;
+	int compiled;
+	int *next;			// next[state * SYMBOLS + symbol], -1 if none before compiling
+	int *out;			// First of the patterns ending at each state, -1 if none
+	int *out_link;		// Nearest state down the failure links with patterns, -1 if none
+	int states;
+	int allocated;
+	int *id;			// Pattern ids, and the next pattern ending at the same state
+	int *id_next;
+	int ids;
+	int ids_allocated;
+};
+
+// Adds an empty state, returning its number or -1 if out of memory.
+static int matcher_state( struct matcher *m )
+{
+	if ( m->states == m->allocated )
+	{
+		int allocated = m->allocated ? m->allocated * 2 : 64;
+		int *next = realloc( m->next, (size_t) allocated * SYMBOLS * sizeof (int) );
+		if ( next )
+			m->next = next;
+		int *out = realloc( m->out, allocated * sizeof (int) );
+		if ( out )
+			m->out = out;
+		if ( !next || !out )
+			return -1;
+		m->allocated = allocated;
+	}
+	int s = m->states++;
+	memset( m->next + (size_t) s * SYMBOLS, 0xFF, SYMBOLS * sizeof (int) );
+	m->out[s] = -1;
+	return s;
+}
+
+struct matcher *matcher_new( int ignore_case )
+{
+	struct matcher *m = calloc( 1, sizeof (struct matcher) );
+	if ( !m )
+		return NULL;
+	m->ignore_case = ignore_case;
+	if ( matcher_state( m ) < 0 )
+	{
+		matcher_free( m );
+		return NULL;
+	}
+	return m;
+}
+
+void matcher_free( struct matcher *m )
+{
+	if ( !m )
+		return;
+	free( m->next );
+	free( m->out );
+	free( m->out_link );
+	free( m->id );
+	free( m->id_next );
+	free( m );
+}
+
+// Steps from state s on sym in the trie, adding a state if there isn't one.
+static int matcher_step( struct matcher *m, int s, int sym )
+{
+	int t = m->next[(size_t) s * SYMBOLS + sym];
+	if ( t < 0 )
+	{
+		t = matcher_state( m );
+		if ( t >= 0 )
+			m->next[(size_t) s * SYMBOLS + sym] = t;
+	}
+	return t;
+}
+
+int matcher_add( struct matcher *m, const char *pattern, size_t len, int id )
+{
+	if ( m->compiled )
+		return -1;
+	int s = 0;
+	size_t i = 0;
+	if ( len == 1 && pattern[0] == '*' )
+		len = 0;
+	if ( len > 0 && pattern[0] == '^' )
+	{
+		s = matcher_step( m, s, SYM_START );
+		i++;
+	}
+	int end = len > i && pattern[len-1] == '$';
+	if ( end )
+		len--;
+	for ( ; i < len && s >= 0; i++ )
+	{
+		unsigned char c = pattern[i];
+		s = matcher_step( m, s, m->ignore_case ? tolower( c ) : c );
+	}
+	if ( end && s >= 0 )
+		s = matcher_step( m, s, SYM_END );
+	if ( s < 0 )
+		return -1;
+
+	if ( m->ids == m->ids_allocated )
+	{
+		int allocated = m->ids_allocated ? m->ids_allocated * 2 : 64;
+		int *ids = realloc( m->id, allocated * sizeof (int) );
+		if ( ids )
+			m->id = ids;
+		int *ids_next = realloc( m->id_next, allocated * sizeof (int) );
+		if ( ids_next )
+			m->id_next = ids_next;
+		if ( !ids || !ids_next )
+			return -1;
+		m->ids_allocated = allocated;
+	}
+	m->id[m->ids] = id;
+	m->id_next[m->ids] = m->out[s];
+	m->out[s] = m->ids++;
+	return 0;
+}
+
+int matcher_compile( struct matcher *m )
+{
+	int *fail = malloc( m->states * sizeof (int) );
+	int *queue = malloc( m->states * sizeof (int) );
+	m->out_link = malloc( m->states * sizeof (int) );
+	if ( !fail || !queue || !m->out_link )
+	{
+		free( fail );
+		free( queue );
+		return -1;
+	}
+
+	// Breadth first, so a state's failure link is always done before it.
+	int head = 0, tail = 0, sym;
+	int *root = m->next;
+	fail[0] = 0;
+	m->out_link[0] = -1;
+	for ( sym = 0; sym < SYMBOLS; sym++ )
+	{
+		if ( root[sym] < 0 )
+			root[sym] = 0;
+		else
+		{
+			fail[root[sym]] = 0;
+			queue[tail++] = root[sym];
+		}
+	}
+	while ( head < tail )
+	{
+		int s = queue[head++];
+		int f = fail[s];
+		m->out_link[s] = m->out[f] >= 0 ? f : m->out_link[f];
+		int *next = m->next + (size_t) s * SYMBOLS;
+		const int *fail_next = m->next + (size_t) f * SYMBOLS;
+		for ( sym = 0; sym < SYMBOLS; sym++ )
+		{
+			if ( next[sym] < 0 )
+				next[sym] = fail_next[sym];
+			else
+			{
+				fail[next[sym]] = fail_next[sym];
+				queue[tail++] = next[sym];
+			}
+		}
+	}
+	free( fail );
+	free( queue );
+	m->compiled = 1;
+	return 0;
+}
+
+// Reports the patterns ending at state s.
+static void matcher_report( const struct matcher *m, int s, void (*found)( int id, void *arg ), void *arg )
+{
+	if ( m->out[s] < 0 )
+		s = m->out_link[s];
+	for ( ; s >= 0; s = m->out_link[s] )
+	{
+		int i;
+		for ( i = m->out[s]; i >= 0; i = m->id_next[i] )
+			found( m->id[i], arg );
+	}
+}
+
+void matcher_run( const struct matcher *m, const char *s, size_t len,
+				  void (*found)( int id, void *arg ), void *arg )
+{
+	const unsigned char *p = (const unsigned char *) s, *end = p + len;
+	int state = m->next[SYM_START];
+	matcher_report( m, state, found, arg );
+	for ( ; p < end; p++ )
+	{
+		state = m->next[(size_t) state * SYMBOLS + ( m->ignore_case ? tolower( *p ) : *p )];
+		matcher_report( m, state, found, arg );
+	}
+	state = m->next[(size_t) state * SYMBOLS + SYM_END];
+	matcher_report( m, state, found, arg );
+}
+
+int matcher_any( const struct matcher *m, const char *s, size_t len )
+{
+	const unsigned char *p = (const unsigned char *) s, *end = p + len;
+	int state = m->next[SYM_START];
+	if ( m->out[state] >= 0 || m->out_link[state] >= 0 )
+		return 1;
+	for ( ; p < end; p++ )
+	{
+		state = m->next[(size_t) state * SYMBOLS + ( m->ignore_case ? tolower( *p ) : *p )];
+		if ( m->out[state] >= 0 || m->out_link[state] >= 0 )
+			return 1;
+	}
+	state = m->next[(size_t) state * SYMBOLS + SYM_END];
+	return m->out[state] >= 0 || m->out_link[state] >= 0;
+}
@@ -0,0 +1,41 @@
+// nvram_match.h
+// Copyright 2015, Todd Knarr <tknarr@silverglass.org>
+// Licensed under the terms of the GPL v3 or any later version.
+// See LICENSE.md for complete license terms.
+
+// Matching a name against many patterns at once, for nvram_dump's --lint
+// and --redact. The patterns are compiled into a single Aho-Corasick
+// automaton, so a name is looked at once, a byte at a time, however many
+// patterns there are.
+//
+// A pattern matches names that contain it. A '^' at the start of a pattern
+// anchors it to the start of the name and a '$' at the end to the end, so
+// "^wl0_" matches names starting with "wl0_" and "^lan_ipaddr$" only that
+// name. "*" by itself matches every name.
+
+#ifndef NVRAM_MATCH_H
+#define NVRAM_MATCH_H
+
+#include <stddef.h>
+
+struct matcher;
+
+// Returns a new, empty matcher, or NULL if out of memory. If ignore_case is
+// set, ASCII letters match whatever their case.
+struct matcher *matcher_new( int ignore_case );
+// Adds a pattern of len bytes, reported as id when it matches. Returns 0 on
+// success or -1 if out of memory. Patterns can't be added once the matcher
+// has been compiled.
+int matcher_add( struct matcher *m, const char *pattern, size_t len, int id );
+// Builds the automaton. Returns 0 on success or -1 if out of memory.
+int matcher_compile( struct matcher *m );
+void matcher_free( struct matcher *m );
+
+// Calls found( id, arg ) for every pattern matching the len bytes at s,
+// possibly more than once for a pattern found more than once.
+void matcher_run( const struct matcher *m, const char *s, size_t len,
+				  void (*found)( int id, void *arg ), void *arg );
+// Returns non-zero if any pattern matches, stopping at the first one.
+int matcher_any( const struct matcher *m, const char *s, size_t len );
+
+#endif // NVRAM_MATCH_H
@@ -0,0 +1,140 @@
+// nvram_queue.h
+// Copyright 2015, Todd Knarr <tknarr@silverglass.org>
+// Licensed under the terms of the GPL v3 or any later version.
+// See LICENSE.md for complete license terms.
+
+// Bounded lock-free queue of pointers with one producer thread and one
+// consumer thread. The producer only writes tail and the consumer only
+// writes head, so no locks are needed to push and pop. The waiting versions
+// of push and pop yield the CPU for a while in case the other side catches
+// up quickly, then sleep until it wakes them, so a side that's stuck behind
+// slow I/O on the other doesn't keep a core busy.
+
+#ifndef NVRAM_QUEUE_H
+#define NVRAM_QUEUE_H
+
+#include <sched.h>
+#include <pthread.h>
+
+#define QUEUE_SIZE	8	// Must be a power of two
+#define QUEUE_SPINS	64	// Times to yield before sleeping
+#define CACHE_LINE	64	// Alignment a structure holding a queue needs
+
+struct spsc_queue
+{
+	void *items[QUEUE_SIZE];
+	// Kept on separate cache lines so the two threads don't contend. Every
+	// access to head, tail and waiting is sequentially consistent, so a side
+	// about to sleep either sees the other's change to the queue or the
+	// other sees it waiting and wakes it.
+	unsigned head __attribute__(( aligned( CACHE_LINE ) ));
+	unsigned tail __attribute__(( aligned( CACHE_LINE ) ));
+	// Threads asleep waiting on the queue, changed only with lock held.
+	int waiting __attribute__(( aligned( CACHE_LINE ) ));
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+};
+
+static inline void queue_init( struct spsc_queue *q )
+{
+	q->head = 0;
+	q->tail = 0;
+	q->waiting = 0;
+	pthread_mutex_init( &q->lock, NULL );
+	pthread_cond_init( &q->wake, NULL );
+}
+
+static inline void queue_destroy( struct spsc_queue *q )
+{
+	pthread_mutex_destroy( &q->lock );
+	pthread_cond_destroy( &q->wake );
+}
+
+static inline int queue_try_push( struct spsc_queue *q, void *item )
+{
+	unsigned tail = q->tail;
+	if ( tail - __atomic_load_n( &q->head, __ATOMIC_SEQ_CST ) == QUEUE_SIZE )
+		return 0;
+	q->items[tail & ( QUEUE_SIZE - 1 )] = item;
+	__atomic_store_n( &q->tail, tail + 1, __ATOMIC_SEQ_CST );
+	return 1;
+}
+
+static inline void *queue_try_pop( struct spsc_queue *q )
+{
+	unsigned head = q->head;
+	if ( head == __atomic_load_n( &q->tail, __ATOMIC_SEQ_CST ) )
+		return NULL;
+	void *item = q->items[head & ( QUEUE_SIZE - 1 )];
+	__atomic_store_n( &q->head, head + 1, __ATOMIC_SEQ_CST );
+	return item;
+}
+
+// Wakes the other side if it's asleep.
+static inline void queue_wake( struct spsc_queue *q )
+{
+	if ( __atomic_load_n( &q->waiting, __ATOMIC_SEQ_CST ) )
+	{
+		pthread_mutex_lock( &q->lock );
+		pthread_cond_broadcast( &q->wake );
+		pthread_mutex_unlock( &q->lock );
+	}
+}
+
+// Returns 0 if the queue was full.
+static inline int queue_push( struct spsc_queue *q, void *item )
+{
+	if ( !queue_try_push( q, item ) )
+		return 0;
+	queue_wake( q );
+	return 1;
+}
+
+// Returns NULL if the queue was empty.
+static inline void *queue_pop( struct spsc_queue *q )
+{
+	void *item = queue_try_pop( q );
+	if ( item )
+		queue_wake( q );
+	return item;
+}
+
+static inline void queue_push_wait( struct spsc_queue *q, void *item )
+{
+	int spins;
+	for ( spins = 0; spins < QUEUE_SPINS; spins++ )
+	{
+		if ( queue_push( q, item ) )
+			return;
+		sched_yield();
+	}
+	pthread_mutex_lock( &q->lock );
+	__atomic_add_fetch( &q->waiting, 1, __ATOMIC_SEQ_CST );
+	while ( !queue_try_push( q, item ) )
+		pthread_cond_wait( &q->wake, &q->lock );
+	__atomic_sub_fetch( &q->waiting, 1, __ATOMIC_SEQ_CST );
+	pthread_mutex_unlock( &q->lock );
+	queue_wake( q );
+}
+
+static inline void *queue_pop_wait( struct spsc_queue *q )
+{
+	void *item;
+	int spins;
+	for ( spins = 0; spins < QUEUE_SPINS; spins++ )
+	{
+		if ( ( item = queue_pop( q ) ) != NULL )
+			return item;
+		sched_yield();
+	}
+	pthread_mutex_lock( &q->lock );
+	__atomic_add_fetch( &q->waiting, 1, __ATOMIC_SEQ_CST );
+	while ( !( item = queue_try_pop( q ) ) )
+		pthread_cond_wait( &q->wake, &q->lock );
+	__atomic_sub_fetch( &q->waiting, 1, __ATOMIC_SEQ_CST );
+	pthread_mutex_unlock( &q->lock );
+	queue_wake( q );
+	return item;
+}
+
+#endif // NVRAM_QUEUE_H
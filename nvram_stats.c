@@ -0,0 +1,125 @@
+// nvram_stats.c
+// Copyright 2015, Todd Knarr <tknarr@silverglass.org>
+// Licensed under the terms of the GPL v3 or any later version.
+// See LICENSE.md for complete license terms.
+
+//	  This program is free software: you can redistribute it and/or modify
+//	  it under the terms of the GNU General Public License as published by
+//	  the Free Software Foundation, either version 3 of the License, or
+//	  (at your option) any later version.
+
+//	  This program is distributed in the hope that it will be useful,
+//	  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+//	  GNU General Public License for more details.
+
+//	  You should have received a copy of the GNU General Public License
+//	  along with this program.	If not, see <http://www.gnu.org/licenses/>.
+
+// Timing and counters for the --stats option. Reports go to the standard
+// error stream so they never mix with the tools' normal output.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "nvram_stats.h"
+#include "nvram_trace.h"
+
+int stats_enabled = 0;
+const char *stats_escape_name = "escape";
+
+static const char *phase_names[PHASE_COUNT] = { "read", "parse", NULL, "output" };
+
+static const char *phase_name( int phase )
+{
+	return phase_names[phase] ? phase_names[phase] : stats_escape_name;
+}
+
+double stats_now( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void stats_clear( struct nvram_stats *s )
+{
+	memset( s, 0, sizeof (struct nvram_stats) );
+}
+
+void stats_record( struct nvram_stats *s, unsigned long record_len )
+{
+	s->records++;
+	if ( record_len > s->largest_record )
+		s->largest_record = record_len;
+}
+
+void stats_phase_end( struct nvram_stats *s, int phase, double *t_start, const char *filename )
+{
+	double t = stats_now();
+	s->phase_time[phase] += t - *t_start;
+	trace_span( phase_name( phase ), "phase", *t_start, t, filename );
+	*t_start = t;
+}
+
+void stats_phase_add( struct nvram_stats *s, int phase, double *t_start )
+{
+	if ( !stats_enabled )
+		return;
+	double t = stats_now();
+	s->phase_time[phase] += t - *t_start;
+	*t_start = t;
+}
+
+void stats_add( struct nvram_stats *total, const struct nvram_stats *s )
+{
+	int i;
+	for ( i = 0; i < PHASE_COUNT; i++ )
+		total->phase_time[i] += s->phase_time[i];
+	total->bytes_in += s->bytes_in;
+	total->bytes_out += s->bytes_out;
+	total->records += s->records;
+	if ( s->largest_record > total->largest_record )
+		total->largest_record = s->largest_record;
+	total->files += s->files;
+}
+
+// Megabytes per second, or 0 if the time is too small to measure.
+static double throughput( unsigned long long bytes, double seconds )
+{
+	if ( seconds <= 0.0 )
+		return 0.0;
+	return bytes / seconds / ( 1024.0 * 1024.0 );
+}
+
+void stats_report( FILE *out, const char *filename, const struct nvram_stats *s )
+{
+	const char *label = filename ? filename : "total";
+	double elapsed = 0.0;
+	int i;
+
+	for ( i = 0; i < PHASE_COUNT; i++ )
+		elapsed += s->phase_time[i];
+
+	if ( !filename )
+		fprintf( out, "stats: %s: %lu files\n", label, s->files );
+	fprintf( out, "stats: %s: %lu records, largest record %lu bytes\n",
+			 label, s->records, s->largest_record );
+	fprintf( out, "stats: %s: %llu bytes in, %llu bytes out, %.6fs, %.2f MB/s in\n",
+			 label, s->bytes_in, s->bytes_out, elapsed, throughput( s->bytes_in, elapsed ) );
+	fprintf( out, "stats: %s:", label );
+	for ( i = 0; i < PHASE_COUNT; i++ )
+		fprintf( out, "%s %s %.6fs", i ? "," : "", phase_name( i ),
+				 s->phase_time[i] );
+	fprintf( out, "\n" );
+
+	if ( !filename )
+	{
+		struct rusage ru;
+		if ( getrusage( RUSAGE_SELF, &ru ) == 0 )
+			fprintf( out, "stats: %s: peak RSS %ld KB\n", label, ru.ru_maxrss );
+	}
+}
@@ -0,0 +1,56 @@
+// nvram_stats.h
+// Copyright 2015, Todd Knarr <tknarr@silverglass.org>
+// Licensed under the terms of the GPL v3 or any later version.
+// See LICENSE.md for complete license terms.
+
+// Per-phase timing and throughput counters used by the --stats option of
+// nvram_dump and nvram_build.
+
+#ifndef NVRAM_STATS_H
+#define NVRAM_STATS_H
+
+#include <stdio.h>
+
+// Processing phases. PHASE_ESCAPE covers escape_string() in nvram_dump and
+// unescape_string() in nvram_build.
+#define PHASE_READ		0
+#define PHASE_PARSE		1
+#define PHASE_ESCAPE	2
+#define PHASE_OUTPUT	3
+#define PHASE_COUNT		4
+
+struct nvram_stats
+{
+	double phase_time[PHASE_COUNT];	// Seconds spent in each phase
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	unsigned long records;
+	unsigned long largest_record;	// Size of the largest record in backup format
+	unsigned long files;
+};
+
+// Set from the command line. When zero, nothing is reported.
+extern int stats_enabled;
+// Name used for PHASE_ESCAPE in reports and traces, "escape" by default.
+extern const char *stats_escape_name;
+
+// Monotonic time in seconds.
+double stats_now( void );
+
+void stats_clear( struct nvram_stats *s );
+// Counts one record of the given length in backup format.
+void stats_record( struct nvram_stats *s, unsigned long record_len );
+// Ends a phase of work on filename: charges the time since *t_start to
+// phase, emits a trace span for it and restarts *t_start at the current time.
+void stats_phase_end( struct nvram_stats *s, int phase, double *t_start, const char *filename );
+// Like stats_phase_end() but without a trace span, for phases that are
+// repeated for every record. Does nothing unless stats_enabled is set.
+void stats_phase_add( struct nvram_stats *s, int phase, double *t_start );
+// Adds the counters in s into total.
+void stats_add( struct nvram_stats *total, const struct nvram_stats *s );
+
+// Writes one report for a single file, or for the totals if filename is NULL.
+// The totals report includes the process's peak RSS.
+void stats_report( FILE *out, const char *filename, const struct nvram_stats *s );
+
+#endif // NVRAM_STATS_H
@@ -0,0 +1,321 @@
+// nvram_tar.c
+// Copyright 2015, Todd Knarr <tknarr@silverglass.org>
+// Licensed under the terms of the GPL v3 or any later version.
+// See LICENSE.md for complete license terms.
+
+//	  This program is free software: you can redistribute it and/or modify
+//	  it under the terms of the GNU General Public License as published by
+//	  the Free Software Foundation, either version 3 of the License, or
+//	  (at your option) any later version.
+
+//	  This program is distributed in the hope that it will be useful,
+//	  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+//	  GNU General Public License for more details.
+
+//	  You should have received a copy of the GNU General Public License
+//	  along with this program.	If not, see <http://www.gnu.org/licenses/>.
+
+// A tar archive is a series of 512-byte header blocks, each followed by the
+// member's data padded to a whole block, and ends with two blocks of zeroes.
+// Names longer than the header's 100 characters come from the ustar prefix
+// field, a GNU 'L' member or a pax 'x' member's path record. The archive is
+// only ever read front to back so it can come from a pipe or a decompressor.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nvram_tar.h"
+
+// Offsets and sizes of the header fields used.
+#define TAR_NAME		0
+#define TAR_NAME_LEN	100
+#define TAR_MODE		100
+#define TAR_UID			108
+#define TAR_GID			116
+#define TAR_SIZE		124
+#define TAR_MTIME		136
+#define TAR_CHKSUM		148
+#define TAR_TYPE		156
+#define TAR_MAGIC		257
+#define TAR_VERSION		263
+#define TAR_PREFIX		345
+#define TAR_PREFIX_LEN	155
+
+// Largest pax extended header read; bigger ones are skipped.
+#define PAX_MAX			( 64*1024 )
+
+// Bytes of padding after a member of size bytes.
+static size_t tar_pad( unsigned long long size )
+{
+	return ( TAR_BLOCK - size % TAR_BLOCK ) % TAR_BLOCK;
+}
+
+// Reads a numeric field, in octal or, for values too big for that, GNU's
+// base-256 form flagged by the high bit of the first byte.
+static unsigned long long tar_number( const unsigned char *p, int len )
+{
+	unsigned long long value = 0;
+	int i = 0;
+	if ( p[0] & 0x80 )
+	{
+		for ( i = 1; i < len; i++ )
+			value = ( value << 8 ) | p[i];
+		return value;
+	}
+	while ( i < len && p[i] == ' ' )
+		i++;
+	for ( ; i < len && p[i] >= '0' && p[i] <= '7'; i++ )
+		value = value * 8 + ( p[i] - '0' );
+	return value;
+}
+
+// Sum of the header's bytes with the checksum field taken as spaces.
+static unsigned int tar_checksum( const unsigned char *block )
+{
+	unsigned int sum = 0;
+	int i;
+	for ( i = 0; i < TAR_BLOCK; i++ )
+		sum += ( i >= TAR_CHKSUM && i < TAR_CHKSUM + 8 ) ? ' ' : block[i];
+	return sum;
+}
+
+int tar_is_header( const unsigned char *block, size_t size )
+{
+	if ( size < TAR_BLOCK || memcmp( block + TAR_MAGIC, "ustar", 5 ) != 0 )
+		return 0;
+	return tar_number( block + TAR_CHKSUM, 8 ) == tar_checksum( block );
+}
+
+void tar_open( struct tar_reader *t, FILE *f, const unsigned char *first )
+{
+	memset( t, 0, sizeof (struct tar_reader) );
+	t->f = f;
+	t->first = first;
+}
+
+// Reads the next block. Returns 1 if there was one, 0 at the end of the
+// file and -1 on an error or a partial block.
+static int tar_block( struct tar_reader *t, unsigned char *block )
+{
+	if ( t->first )
+	{
+		memcpy( block, t->first, TAR_BLOCK );
+		t->first = NULL;
+		return 1;
+	}
+	size_t n = fread( block, sizeof (char), TAR_BLOCK, t->f );
+	if ( n == TAR_BLOCK )
+		return 1;
+	return ( n == 0 && !ferror( t->f ) ) ? 0 : -1;
+}
+
+// Reads size bytes of member data plus padding, keeping up to max - 1 bytes
+// of it in keep as a string. keep may be NULL to just skip it.
+static int tar_data( struct tar_reader *t, unsigned long long size, char *keep, size_t max )
+{
+	unsigned char block[TAR_BLOCK];
+	unsigned long long pos;
+	for ( pos = 0; pos < size; pos += TAR_BLOCK )
+	{
+		if ( tar_block( t, block ) != 1 )
+			return -1;
+		if ( keep && pos < max - 1 )
+		{
+			size_t n = size - pos < TAR_BLOCK ? size - pos : TAR_BLOCK;
+			if ( n > max - 1 - pos )
+				n = max - 1 - pos;
+			memcpy( keep + pos, block, n );
+		}
+	}
+	if ( keep )
+		keep[size < max - 1 ? size : max - 1] = 0;
+	return 0;
+}
+
+// Finds the path record in a pax extended header, each record being
+// "<length> <key>=<value>\n".
+static void pax_path( const char *pax, size_t size, char *name )
+{
+	size_t pos = 0;
+	while ( pos < size )
+	{
+		char *end;
+		unsigned long len = strtoul( pax + pos, &end, 10 );
+		if ( len == 0 || pos + len > size || *end != ' ' )
+			return;
+		const char *key = end + 1, *record_end = pax + pos + len - 1;
+		if ( strncmp( key, "path=", 5 ) == 0 && key + 5 <= record_end )
+		{
+			size_t n = record_end - ( key + 5 );
+			if ( n >= TAR_NAME_MAX )
+				n = TAR_NAME_MAX - 1;
+			memcpy( name, key + 5, n );
+			name[n] = 0;
+		}
+		pos += len;
+	}
+}
+
+int tar_next( struct tar_reader *t )
+{
+	unsigned char block[TAR_BLOCK];
+	char long_name[TAR_NAME_MAX];
+	long_name[0] = 0;
+
+	// Skip whatever's left of the current member and its padding.
+	if ( t->left > 0 )
+	{
+		unsigned long long skip = t->left + tar_pad( t->size );
+		while ( skip > 0 )
+		{
+			size_t n = skip < TAR_BLOCK ? skip : TAR_BLOCK;
+			if ( fread( block, sizeof (char), n, t->f ) != n )
+				return -1;
+			skip -= n;
+		}
+		t->left = 0;
+	}
+
+	for ( ;; )
+	{
+		int sts = tar_block( t, block );
+		if ( sts <= 0 )
+			return sts;
+		int i;
+		for ( i = 0; i < TAR_BLOCK && block[i] == 0; i++ )
+			;
+		if ( i == TAR_BLOCK )
+			return 0; // End of archive
+		if ( !tar_is_header( block, TAR_BLOCK ) )
+			return -1;
+
+		unsigned long long size = tar_number( block + TAR_SIZE, 12 );
+		char type = block[TAR_TYPE];
+		if ( type == 'L' )
+		{
+			// GNU long name for the next member
+			if ( tar_data( t, size, long_name, TAR_NAME_MAX ) != 0 )
+				return -1;
+		}
+		else if ( type == 'x' && size < PAX_MAX )
+		{
+			// pax extended header for the next member
+			char *pax = malloc( size + 1 );
+			if ( !pax )
+				return -1;
+			sts = tar_data( t, size, pax, size + 1 );
+			if ( sts == 0 )
+				pax_path( pax, size, long_name );
+			free( pax );
+			if ( sts != 0 )
+				return -1;
+		}
+		else if ( type == '0' || type == '\0' || type == '7' )
+		{
+			if ( long_name[0] )
+				strcpy( t->name, long_name );
+			else if ( block[TAR_PREFIX] )
+				snprintf( t->name, TAR_NAME_MAX, "%.*s/%.*s", TAR_PREFIX_LEN, block + TAR_PREFIX,
+						  TAR_NAME_LEN, block + TAR_NAME );
+			else
+				snprintf( t->name, TAR_NAME_MAX, "%.*s", TAR_NAME_LEN, block + TAR_NAME );
+			t->size = size;
+			t->left = size;
+			return 1;
+		}
+		else
+		{
+			// Directories, links and the like have nothing for us.
+			if ( tar_data( t, size, NULL, 0 ) != 0 )
+				return -1;
+			long_name[0] = 0;
+		}
+	}
+}
+
+size_t tar_read( struct tar_reader *t, void *buffer, size_t size )
+{
+	if ( size > t->left )
+		size = t->left;
+	size_t n = fread( buffer, sizeof (char), size, t->f );
+	t->left -= n;
+	if ( n > 0 && t->left == 0 )
+	{
+		// Step over the padding, so the next header is up next.
+		unsigned char pad[TAR_BLOCK];
+		size_t pad_len = tar_pad( t->size );
+		if ( pad_len > 0 && fread( pad, sizeof (char), pad_len, t->f ) != pad_len )
+			return 0;
+	}
+	else if ( n < size )
+		t->left = 0; // Error or a truncated archive, the next tar_next() will fail
+	return n;
+}
+
+// Writes one header block.
+static int tar_header_block( FILE *out, const char *name, size_t name_len, const char *prefix,
+							 size_t prefix_len, unsigned long long size, char type )
+{
+	unsigned char block[TAR_BLOCK];
+	memset( block, 0, sizeof block );
+	memcpy( block + TAR_NAME, name, name_len );
+	memcpy( block + TAR_PREFIX, prefix, prefix_len );
+	memcpy( block + TAR_MODE, "0000644", 7 );
+	memcpy( block + TAR_UID, "0000000", 7 );
+	memcpy( block + TAR_GID, "0000000", 7 );
+	if ( size < 077777777777ULL )
+		snprintf( (char *) block + TAR_SIZE, 12, "%011llo", size );
+	else
+	{
+		int i;
+		block[TAR_SIZE] = 0x80;
+		for ( i = 11; i > 0; i--, size >>= 8 )
+			block[TAR_SIZE + i] = size & 0xFF;
+	}
+	snprintf( (char *) block + TAR_MTIME, 12, "%011llo", (unsigned long long) time( NULL ) );
+	block[TAR_TYPE] = type;
+	memcpy( block + TAR_MAGIC, "ustar", 6 );
+	memcpy( block + TAR_VERSION, "00", 2 );
+	snprintf( (char *) block + TAR_CHKSUM, 8, "%06o", tar_checksum( block ) );
+	block[TAR_CHKSUM + 7] = ' ';
+	return fwrite( block, sizeof (char), TAR_BLOCK, out ) == TAR_BLOCK ? 0 : 1;
+}
+
+int tar_write_header( FILE *out, const char *name, unsigned long long size )
+{
+	size_t len = strlen( name );
+	if ( len <= TAR_NAME_LEN )
+		return tar_header_block( out, name, len, "", 0, size, '0' );
+
+	// Split a long name between the prefix and name fields at a slash if it
+	// fits, or else put it in a GNU long name member first.
+	const char *slash = name + len - TAR_NAME_LEN - 1;
+	while ( ( slash = strchr( slash, '/' ) ) != NULL && slash - name <= TAR_PREFIX_LEN )
+	{
+		if ( slash > name && len - ( slash - name ) - 1 <= TAR_NAME_LEN )
+			return tar_header_block( out, slash + 1, len - ( slash - name ) - 1, name, slash - name,
+									 size, '0' );
+		slash++;
+	}
+	if ( tar_header_block( out, "././@LongLink", 13, "", 0, len + 1, 'L' ) != 0 ||
+		 fwrite( name, sizeof (char), len + 1, out ) != len + 1 ||
+		 tar_write_pad( out, len + 1 ) != 0 )
+		return 1;
+	return tar_header_block( out, name, TAR_NAME_LEN, "", 0, size, '0' );
+}
+
+int tar_write_pad( FILE *out, unsigned long long size )
+{
+	static const unsigned char zeroes[TAR_BLOCK];
+	size_t pad_len = tar_pad( size );
+	return fwrite( zeroes, sizeof (char), pad_len, out ) == pad_len ? 0 : 1;
+}
+
+int tar_write_end( FILE *out )
+{
+	static const unsigned char zeroes[TAR_BLOCK * 2];
+	return fwrite( zeroes, sizeof (char), sizeof zeroes, out ) == sizeof zeroes ? 0 : 1;
+}
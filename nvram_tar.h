@@ -0,0 +1,56 @@
+// nvram_tar.h
+// Copyright 2015, Todd Knarr <tknarr@silverglass.org>
+// Licensed under the terms of the GPL v3 or any later version.
+// See LICENSE.md for complete license terms.
+
+// Minimal tar archive support: reading the regular files out of a ustar,
+// GNU or pax archive as a stream, for nvram_dump, and writing one, for
+// nvram_build. Only what's needed to get backups in and out; ownership,
+// permissions and the like are ignored on reading and made up on writing.
+
+#ifndef NVRAM_TAR_H
+#define NVRAM_TAR_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define TAR_BLOCK		512
+// Longest member name kept when reading.
+#define TAR_NAME_MAX	1024
+// Largest member read into memory. A router's NVRAM is at most a few MB, so
+// anything bigger than this isn't a backup, and the size in the header
+// can't be trusted enough to allocate it.
+#define TAR_MEMBER_MAX	( 64ULL*1024*1024 )
+
+struct tar_reader
+{
+	FILE *f;
+	char name[TAR_NAME_MAX];	// Name of the current member
+	unsigned long long size;	// Size of the current member
+	unsigned long long left;	// Bytes of it not read yet
+	const unsigned char *first;	// Header block already read by the caller
+};
+
+// Returns non-zero if block is a valid tar header block.
+int tar_is_header( const unsigned char *block, size_t size );
+
+// Starts reading an archive from f. If the caller has already read the first
+// header block to recognize the archive, it's passed as first.
+void tar_open( struct tar_reader *t, FILE *f, const unsigned char *first );
+// Moves to the next regular file in the archive, skipping the rest of the
+// current one. Returns 1 if there is one, 0 at the end of the archive or -1
+// if the archive is corrupt or can't be read.
+int tar_next( struct tar_reader *t );
+// Reads up to size bytes of the current member. Returns the number read,
+// which is less than size only at the end of the member or on an error.
+size_t tar_read( struct tar_reader *t, void *buffer, size_t size );
+
+// Writes a header for a regular file of size bytes called name, which is
+// then followed by the data and tar_write_pad(). Returns 0 on success.
+int tar_write_header( FILE *out, const char *name, unsigned long long size );
+// Pads a member of size bytes out to a whole number of blocks.
+int tar_write_pad( FILE *out, unsigned long long size );
+// Writes the end of archive marker.
+int tar_write_end( FILE *out );
+
+#endif // NVRAM_TAR_H
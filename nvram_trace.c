@@ -0,0 +1,108 @@
+// nvram_trace.c
+// Copyright 2015, Todd Knarr <tknarr@silverglass.org>
+// Licensed under the terms of the GPL v3 or any later version.
+// See LICENSE.md for complete license terms.
+
+//	  This program is free software: you can redistribute it and/or modify
+//	  it under the terms of the GNU General Public License as published by
+//	  the Free Software Foundation, either version 3 of the License, or
+//	  (at your option) any later version.
+
+//	  This program is distributed in the hope that it will be useful,
+//	  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+//	  GNU General Public License for more details.
+
+//	  You should have received a copy of the GNU General Public License
+//	  along with this program.	If not, see <http://www.gnu.org/licenses/>.
+
+// Writes "complete" (ph "X") events in the Chrome trace-event JSON format.
+// Timestamps are microseconds since the trace was opened. Events are
+// written as they happen, so a crashed run still leaves a file that most
+// viewers will load.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "nvram_stats.h"
+#include "nvram_trace.h"
+
+int trace_enabled = 0;
+
+static FILE *trace_file = NULL;
+static double trace_start = 0.0;
+static int trace_events = 0;
+static int trace_next_tid = 1;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int trace_tid = 0;
+
+int trace_open( const char *filename )
+{
+	// A repeated --trace replaces the earlier file, which is finished first.
+	trace_close();
+	trace_file = fopen( filename, "w" );
+	if ( !trace_file )
+	{
+		int code = errno;
+		fprintf( stderr, "trace_open: Error opening %s for output: %s\n", filename, strerror( code ) );
+		return 1;
+	}
+	fprintf( trace_file, "{\"traceEvents\":[" );
+	trace_events = 0;
+	trace_start = stats_now();
+	trace_enabled = 1;
+	return 0;
+}
+
+void trace_close( void )
+{
+	if ( !trace_file )
+		return;
+	fprintf( trace_file, "\n]}\n" );
+	fclose( trace_file );
+	trace_file = NULL;
+	trace_enabled = 0;
+}
+
+// Writes s as the contents of a JSON string.
+static void trace_write_string( const char *s )
+{
+	for ( ; *s; s++ )
+	{
+		unsigned char c = (unsigned char) *s;
+		if ( c == '"' || c == '\\' )
+			fprintf( trace_file, "\\%c", c );
+		else if ( c < 0x20 )
+			fprintf( trace_file, "\\u%04x", c );
+		else
+			fputc( c, trace_file );
+	}
+}
+
+void trace_span( const char *name, const char *category, double start, double end,
+				 const char *filename )
+{
+	if ( !trace_enabled )
+		return;
+
+	pthread_mutex_lock( &trace_lock );
+	if ( trace_tid == 0 )
+		trace_tid = trace_next_tid++;
+	fprintf( trace_file, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+			 "\"pid\":%d,\"tid\":%d",
+			 trace_events ? "," : "", name, category,
+			 ( start - trace_start ) * 1e6, ( end - start ) * 1e6, (int) getpid(), trace_tid );
+	if ( filename )
+	{
+		fprintf( trace_file, ",\"args\":{\"file\":\"" );
+		trace_write_string( filename );
+		fprintf( trace_file, "\"}" );
+	}
+	fprintf( trace_file, "}" );
+	trace_events++;
+	pthread_mutex_unlock( &trace_lock );
+}
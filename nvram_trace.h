@@ -0,0 +1,27 @@
+// nvram_trace.h
+// Copyright 2015, Todd Knarr <tknarr@silverglass.org>
+// Licensed under the terms of the GPL v3 or any later version.
+// See LICENSE.md for complete license terms.
+
+// Chrome trace-event output for the --trace option of nvram_dump and
+// nvram_build. The file can be loaded into chrome://tracing or Perfetto.
+
+#ifndef NVRAM_TRACE_H
+#define NVRAM_TRACE_H
+
+// Non-zero once trace_open() has succeeded.
+extern int trace_enabled;
+
+// Creates the trace file. Returns 0 on success, 1 on error.
+int trace_open( const char *filename );
+// Finishes the JSON document and closes the trace file. Does nothing if
+// no trace file is open, so it's safe to call more than once.
+void trace_close( void );
+
+// Records a complete span from start to end, both in stats_now() seconds.
+// If filename is not NULL it's attached to the span as an argument. Safe to
+// call from any thread; each thread gets its own tid in the trace.
+void trace_span( const char *name, const char *category, double start, double end,
+				 const char *filename );
+
+#endif // NVRAM_TRACE_H